@@ -0,0 +1,394 @@
+//
+//  main.c
+//  UnchainedSocket replay tool
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+
+#include "capture.h"
+
+// macOS uses SO_NOSIGPIPE instead
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// time to wait for outstanding responses after the last event
+#define DRAIN_TIMEOUT_US 2000000
+
+// one event of the log
+struct event {
+    const capture_record *record;
+    const char *data;
+    int connection;         // index into the connection list
+    int index;              // position in the log, keeps the sort stable
+    uint64_t sent;          // replay time the event was executed
+};
+
+// expected response: fires when `target` bytes have been received
+struct mark {
+    uint64_t target;
+    int reference;          // event index of the request the response belongs to
+    uint64_t recorded;      // latency in the log
+    uint64_t arrival;       // replay time the response was complete, 0 if it never was
+};
+
+struct connection {
+    int32_t id;
+    int fd;
+    bool open;
+    uint64_t received;
+    int reference;          // last request, responses are measured from it
+    struct mark *marks;
+    int numMarks;
+    int nextMark;
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare_events(const void *a, const void *b) {
+    const struct event *ea = (const struct event *)a;
+    const struct event *eb = (const struct event *)b;
+    if (ea->record->timestamp != eb->record->timestamp) {
+        return (ea->record->timestamp < eb->record->timestamp) ? -1 : 1;
+    }
+    return ea->index - eb->index;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    const struct connection *ca = (const struct connection *)a;
+    const struct connection *cb = (const struct connection *)b;
+    return (ca->id > cb->id) - (ca->id < cb->id);
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t la = *(const uint64_t *)a;
+    uint64_t lb = *(const uint64_t *)b;
+    return (la > lb) - (la < lb);
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *info = NULL;
+    if (getaddrinfo(host, port, &hints, &info) != 0) {
+        return -1;
+    }
+    int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if ((fd >= 0) && connect(fd, info->ai_addr, info->ai_addrlen)) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+
+    if (fd >= 0) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(int));
+#endif
+    }
+    return fd;
+}
+
+// write everything, waits for the socket if it is full
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t result = send(fd, data, len, MSG_NOSIGNAL);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd p = { fd, POLLOUT, 0 };
+                poll(&p, 1, 100);
+                continue;
+            }
+            return false;
+        }
+        data += result;
+        len -= result;
+    }
+    return true;
+}
+
+// read everything available on all open connections and complete responses
+static void receive(struct connection *connections, int numConnections, int timeout) {
+    struct pollfd *fds = malloc(numConnections * sizeof(struct pollfd));
+    int *index = malloc(numConnections * sizeof(int));
+    int numFds = 0;
+    for(int i = 0; i < numConnections; i++) {
+        if (connections[i].open) {
+            fds[numFds].fd = connections[i].fd;
+            fds[numFds].events = POLLIN;
+            fds[numFds].revents = 0;
+            index[numFds++] = i;
+        }
+    }
+
+    if (poll(fds, numFds, timeout) > 0) {
+        char buffer[65536];
+        for(int i = 0; i < numFds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            struct connection *c = &connections[index[i]];
+            ssize_t result = read(c->fd, buffer, sizeof(buffer));
+            if ((result < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+                continue;
+            }
+            if (result <= 0) {
+                close(c->fd);
+                c->open = false;
+                continue;
+            }
+
+            c->received += result;
+            uint64_t now = now_us();
+            while ((c->nextMark < c->numMarks) && (c->received >= c->marks[c->nextMark].target)) {
+                c->marks[c->nextMark++].arrival = now;
+            }
+        }
+    }
+
+    free(index);
+    free(fds);
+}
+
+static bool responses_pending(struct connection *connections, int numConnections) {
+    for(int i = 0; i < numConnections; i++) {
+        if (connections[i].open && (connections[i].nextMark < connections[i].numMarks)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        printf("usage: %s <capture log> <host> <port> [speed]\n", argv[0]);
+        printf("  speed: 1 for original timing (default), 2 for twice as fast, 0 for as fast as possible\n");
+        return 1;
+    }
+    double speed = (argc > 4) ? atof(argv[4]) : 1.0;
+
+    // map the log
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || fstat(fd, &st) || ((size_t)st.st_size < sizeof(capture_header))) {
+        printf("Could not open %s\n", argv[1]);
+        return 1;
+    }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    const capture_header *header = (const capture_header *)map;
+    if ((map == MAP_FAILED) || (header->magic != CAPTURE_MAGIC) || (header->version != CAPTURE_VERSION)) {
+        printf("%s is not a capture log\n", argv[1]);
+        return 1;
+    }
+    size_t size = (header->size && (header->size <= (uint64_t)st.st_size)) ? header->size : (uint64_t)st.st_size;
+
+    // collect all events
+    int numEvents = 0;
+    int allocatedEvents = 1024;
+    struct event *events = malloc(allocatedEvents * sizeof(struct event));
+    for(size_t offset = sizeof(capture_header); offset + sizeof(capture_record) <= size; ) {
+        const capture_record *record = (const capture_record *)(map + offset);
+        if ((record->type < CAPTURE_OPEN) || (record->type > CAPTURE_CLOSE) || (offset + CAPTURE_RECORD_SIZE(record->captured) > size)) {
+            break;
+        }
+        if (numEvents == allocatedEvents) {
+            allocatedEvents *= 2;
+            events = realloc(events, allocatedEvents * sizeof(struct event));
+        }
+        events[numEvents].record = record;
+        events[numEvents].data = map + offset + sizeof(capture_record);
+        events[numEvents].index = numEvents;
+        events[numEvents].sent = 0;
+        numEvents++;
+        offset += CAPTURE_RECORD_SIZE(record->captured);
+    }
+    qsort(events, numEvents, sizeof(struct event), compare_events);
+    for(int i = 0; i < numEvents; i++) {
+        events[i].index = i;
+    }
+
+    // one connection per connection ID
+    struct connection *connections = calloc(numEvents + 1, sizeof(struct connection));
+    int numConnections = 0;
+    for(int i = 0; i < numEvents; i++) {
+        connections[numConnections++].id = events[i].record->connection;
+    }
+    qsort(connections, numConnections, sizeof(struct connection), compare_ids);
+    int unique = 0;
+    for(int i = 0; i < numConnections; i++) {
+        if ((unique == 0) || (connections[unique - 1].id != connections[i].id)) {
+            connections[unique++] = connections[i];
+        }
+    }
+    numConnections = unique;
+
+    // responses are expected where the server sent data, measured from the last request
+    uint64_t inBytes = 0;
+    uint64_t outBytes = 0;
+    for(int i = 0; i < numEvents; i++) {
+        struct connection key = { .id = events[i].record->connection };
+        struct connection *c = bsearch(&key, connections, numConnections, sizeof(struct connection), compare_ids);
+        events[i].connection = (int)(c - connections);
+
+        switch (events[i].record->type) {
+            case CAPTURE_IN:
+                inBytes += events[i].record->length;
+                c->reference = i;
+                break;
+            case CAPTURE_OPEN:
+                c->reference = i;
+                break;
+            case CAPTURE_OUT: {
+                outBytes += events[i].record->length;
+                uint64_t target = events[i].record->length + ((c->numMarks > 0) ? c->marks[c->numMarks - 1].target : 0);
+                c->marks = realloc(c->marks, (c->numMarks + 1) * sizeof(struct mark));
+                c->marks[c->numMarks].target = target;
+                c->marks[c->numMarks].reference = c->reference;
+                c->marks[c->numMarks].recorded = events[i].record->timestamp - events[c->reference].record->timestamp;
+                c->marks[c->numMarks].arrival = 0;
+                c->numMarks++;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    printf("Replaying %d events on %d connections (%llu bytes in, %llu bytes out), %llu events were dropped while capturing\n",
+           numEvents, numConnections, (unsigned long long)inBytes, (unsigned long long)outBytes, (unsigned long long)header->dropped);
+
+    // play back
+    uint64_t start = now_us();
+    for(int i = 0; i < numEvents; i++) {
+        struct event *e = &events[i];
+        struct connection *c = &connections[e->connection];
+
+        // wait for the event, reading responses in the meantime
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)(e->record->timestamp / speed);
+            while (42) {
+                uint64_t now = now_us();
+                if (now >= due) {
+                    break;
+                }
+                receive(connections, numConnections, (int)((due - now + 999) / 1000));
+            }
+        } else {
+            receive(connections, numConnections, 0);
+        }
+
+        switch (e->record->type) {
+            case CAPTURE_OPEN:
+                c->fd = connect_to(argv[2], argv[3]);
+                c->open = (c->fd >= 0);
+                if (!c->open) {
+                    printf("Could not connect to %s:%s\n", argv[2], argv[3]);
+                }
+                break;
+            case CAPTURE_IN:
+                if (c->open) {
+                    // data that was not captured is replaced with zeros
+                    char zero[4096];
+                    memset(zero, 0, sizeof(zero));
+                    write_all(c->fd, e->data, e->record->captured);
+                    for(uint32_t sent = e->record->captured; sent < e->record->length; ) {
+                        uint32_t len = (e->record->length - sent < sizeof(zero)) ? e->record->length - sent : sizeof(zero);
+                        write_all(c->fd, zero, len);
+                        sent += len;
+                    }
+                }
+                break;
+            case CAPTURE_CLOSE:
+                if (c->open) {
+                    shutdown(c->fd, SHUT_WR);
+                }
+                break;
+            default:
+                break;
+        }
+        e->sent = now_us();
+    }
+
+    // wait for the remaining responses
+    uint64_t drainUntil = now_us() + DRAIN_TIMEOUT_US;
+    while (responses_pending(connections, numConnections) && (now_us() < drainUntil)) {
+        receive(connections, numConnections, 10);
+    }
+    uint64_t duration = now_us() - start;
+
+    // compare latencies
+    int numMarks = 0;
+    int missing = 0;
+    uint64_t *recorded = malloc((numEvents + 1) * sizeof(uint64_t));
+    uint64_t *replayed = malloc((numEvents + 1) * sizeof(uint64_t));
+    double deviation = 0;
+    for(int i = 0; i < numConnections; i++) {
+        struct connection *c = &connections[i];
+        for(int j = 0; j < c->numMarks; j++) {
+            struct mark *m = &c->marks[j];
+            if (m->arrival == 0) {
+                missing++;
+                continue;
+            }
+            uint64_t sent = events[m->reference].sent;
+            recorded[numMarks] = m->recorded;
+            replayed[numMarks] = (m->arrival > sent) ? m->arrival - sent : 0;
+            deviation += (double)replayed[numMarks] - (double)recorded[numMarks];
+            numMarks++;
+        }
+        if (c->open) {
+            close(c->fd);
+        }
+        free(c->marks);
+    }
+
+    printf("Replay took %.3f s, %d responses, %d missing\n", duration / 1000000.0, numMarks, missing);
+    if (numMarks > 0) {
+        qsort(recorded, numMarks, sizeof(uint64_t), compare_latency);
+        qsort(replayed, numMarks, sizeof(uint64_t), compare_latency);
+        printf("latency (us)     p50        p90        p99        max\n");
+        printf("recorded  %10llu %10llu %10llu %10llu\n",
+               (unsigned long long)recorded[numMarks / 2], (unsigned long long)recorded[numMarks * 9 / 10],
+               (unsigned long long)recorded[numMarks * 99 / 100], (unsigned long long)recorded[numMarks - 1]);
+        printf("replayed  %10llu %10llu %10llu %10llu\n",
+               (unsigned long long)replayed[numMarks / 2], (unsigned long long)replayed[numMarks * 9 / 10],
+               (unsigned long long)replayed[numMarks * 99 / 100], (unsigned long long)replayed[numMarks - 1]);
+        printf("mean deviation from recording: %+.1f us\n", deviation / numMarks);
+    }
+
+    free(recorded);
+    free(replayed);
+    free(connections);
+    free(events);
+    munmap((void *)map, st.st_size);
+    close(fd);
+
+    return (missing > 0) ? 2 : 0;
+}
@@ -0,0 +1,126 @@
+//
+//  capture.c
+//  UnchainedSocket
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "capture.h"
+
+struct _capture_log {
+	int fd;
+	char *map;            // mapped log file
+	size_t max_size;
+	size_t snap_length;
+	uint64_t start;       // monotonic start time in microseconds
+
+	size_t offset;        // next free byte, reserved atomically
+	size_t end;           // start of the first record that did not fit
+	uint64_t dropped;
+};
+
+static uint64_t capture_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+capture_log capture_open(const char *path, size_t max_size, size_t snap_length) {
+	if (max_size < sizeof(capture_header)) {
+		return NULL;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		DebugLog("[CAPTURE] Could not open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, max_size)) {
+		DebugLog("[CAPTURE] Could not size %s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	char *map = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		DebugLog("[CAPTURE] Could not map %s: %s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	capture_log log = calloc(sizeof(struct _capture_log), 1);
+	log->fd = fd;
+	log->map = map;
+	log->max_size = max_size;
+	log->snap_length = snap_length;
+	log->start = capture_now();
+	log->offset = sizeof(capture_header);
+	log->end = max_size;
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	capture_header *header = (capture_header *)map;
+	header->magic = CAPTURE_MAGIC;
+	header->version = CAPTURE_VERSION;
+	header->start_time = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+
+	return log;
+}
+
+bool capture_write(capture_log log, int connection, capture_type type, const char *data, size_t length) {
+	size_t captured = (data == NULL) ? 0 : length;
+	if (captured > log->snap_length) {
+		captured = log->snap_length;
+	}
+
+	// reserve space, writers never touch the same bytes
+	size_t size = CAPTURE_RECORD_SIZE(captured);
+	size_t offset = __atomic_fetch_add(&log->offset, size, __ATOMIC_RELAXED);
+	if (offset + size > log->max_size) {
+		// full, remember where the valid part of the log ends
+		size_t end = __atomic_load_n(&log->end, __ATOMIC_RELAXED);
+		while ((offset < end) && !__atomic_compare_exchange_n(&log->end, &end, offset, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			// end has been updated, retry
+		}
+		__atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	capture_record *record = (capture_record *)(log->map + offset);
+	record->timestamp = capture_now() - log->start;
+	record->connection = connection;
+	record->type = type;
+	record->reserved = 0;
+	record->length = (uint32_t)length;
+	record->captured = (uint32_t)captured;
+	if (captured > 0) {
+		memcpy(log->map + offset + sizeof(capture_record), data, captured);
+	}
+
+	return true;
+}
+
+void capture_close(capture_log log) {
+	size_t size = (log->offset < log->end) ? log->offset : log->end;
+
+	capture_header *header = (capture_header *)log->map;
+	header->size = size;
+	header->dropped = log->dropped;
+
+	munmap(log->map, log->max_size);
+	if (ftruncate(log->fd, size)) {
+		DebugLog("[CAPTURE] Could not truncate log: %s\n", strerror(errno));
+	}
+	close(log->fd);
+	free(log);
+}
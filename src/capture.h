@@ -0,0 +1,79 @@
+//
+//  capture.h
+//  UnchainedSocket
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+
+#ifndef __capture_h
+#define __capture_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define CAPTURE_MAGIC 0x55434150 /* 'UCAP' */
+#define CAPTURE_VERSION 1
+
+/** Type of a capture record */
+typedef enum _capture_type {
+	CAPTURE_OPEN = 1,  /**< connection accepted, data is the remote IP */
+	CAPTURE_IN,        /**< data received from the client */
+	CAPTURE_OUT,       /**< data sent to the client */
+	CAPTURE_CLOSE      /**< connection closed */
+} capture_type;
+
+/** File header of a capture log */
+typedef struct _capture_header {
+	uint32_t magic;      /**< `CAPTURE_MAGIC` */
+	uint32_t version;    /**< `CAPTURE_VERSION` */
+	uint64_t start_time; /**< wall clock time of the capture start in microseconds since the epoch */
+	uint64_t size;       /**< bytes of the log that contain records, including this header */
+	uint64_t dropped;    /**< records that did not fit into the log */
+} capture_header;
+
+/** Record header, followed by `captured` bytes of data padded to 8 bytes */
+typedef struct _capture_record {
+	uint64_t timestamp;  /**< microseconds since the capture start */
+	int32_t connection;  /**< connection ID */
+	uint16_t type;       /**< `capture_type` */
+	uint16_t reserved;
+	uint32_t length;     /**< bytes on the wire */
+	uint32_t captured;   /**< bytes of data stored, may be less than `length` */
+} capture_record;
+
+/** Size of a record including its padded data */
+#define CAPTURE_RECORD_SIZE(captured) (sizeof(capture_record) + (((captured) + 7) & ~(size_t)7))
+
+/** Opaque capture log */
+typedef struct _capture_log *capture_log;
+
+/** Create a memory mapped capture log
+ *
+ * @param path: file to write, truncated if it exists
+ * @param max_size: maximum size of the log in bytes, records that do not fit are dropped
+ * @param snap_length: maximum bytes of data stored per record, 0 to store only the lengths
+ * @return capture log or NULL if the file could not be created
+ */
+capture_log capture_open(const char *path, size_t max_size, size_t snap_length);
+
+/** Append a record to the log, safe to call from multiple threads
+ *
+ * @param log: capture log
+ * @param connection: connection ID
+ * @param type: record type
+ * @param data: data of the record, may be NULL
+ * @param length: bytes on the wire
+ * @return false if the log is full
+ */
+bool capture_write(capture_log log, int connection, capture_type type, const char *data, size_t length);
+
+/** Finish the log, truncate the file to the used size and free the handle
+ *
+ * No thread may write to the log anymore when this is called.
+ *
+ * @param log: capture log
+ */
+void capture_close(capture_log log);
+
+#endif /* __capture_h */
@@ -0,0 +1,169 @@
+//
+//  epoch.c
+//  UnchainedSocket
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+// collect after this many retirements
+#define EPOCH_COLLECT_INTERVAL 64
+
+// per thread state, records are never freed but reused when a thread exits
+typedef struct _epoch_record {
+	uint64_t epoch;         // global epoch seen when entering the critical section
+	int depth;              // nesting depth, only touched by the owning thread
+	bool active;            // in a critical section
+	bool in_use;            // owned by a thread
+
+	struct _epoch_record *next;
+} epoch_record;
+
+// retired memory, tagged with the global epoch at retirement
+typedef struct _epoch_retired {
+	void *pointer;
+	epoch_free free_fn;
+	uint64_t epoch;
+
+	struct _epoch_retired *next;
+} epoch_retired;
+
+static uint64_t global_epoch = 0;
+static epoch_record *records = NULL;
+static epoch_retired *retired = NULL;
+static int retired_count = 0;
+static pthread_mutex_t collect_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+
+static void epoch_thread_exit(void *data) {
+	epoch_record *record = (epoch_record *)data;
+	__atomic_store_n(&record->active, false, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&record->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void epoch_make_key(void) {
+	pthread_key_create(&record_key, epoch_thread_exit);
+}
+
+static epoch_record *epoch_local_record(void) {
+	pthread_once(&key_once, epoch_make_key);
+	epoch_record *record = pthread_getspecific(record_key);
+	if (record) {
+		return record;
+	}
+
+	// try to reuse the record of an exited thread
+	for(record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record; record = record->next) {
+		bool expected = false;
+		if (__atomic_compare_exchange_n(&record->in_use, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			record->depth = 0;
+			pthread_setspecific(record_key, record);
+			return record;
+		}
+	}
+
+	// allocate a new one and push it onto the record list
+	record = calloc(sizeof(epoch_record), 1);
+	record->in_use = true;
+	record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&records, &record->next, record, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		// record->next has been updated, retry
+	}
+	pthread_setspecific(record_key, record);
+	return record;
+}
+
+void epoch_enter(void) {
+	epoch_record *record = epoch_local_record();
+	if (record->depth++ > 0) {
+		return;
+	}
+
+	// publish that we are active before loading any shared pointers
+	__atomic_store_n(&record->active, true, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&record->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+	epoch_record *record = epoch_local_record();
+	if (--record->depth > 0) {
+		return;
+	}
+	__atomic_store_n(&record->active, false, __ATOMIC_RELEASE);
+}
+
+void epoch_retire(void *pointer, epoch_free free_fn) {
+	epoch_retired *item = malloc(sizeof(epoch_retired));
+	item->pointer = pointer;
+	item->free_fn = free_fn;
+	item->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+	// push onto the retired list
+	item->next = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&retired, &item->next, item, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		// item->next has been updated, retry
+	}
+
+	if (__atomic_add_fetch(&retired_count, 1, __ATOMIC_RELAXED) % EPOCH_COLLECT_INTERVAL == 0) {
+		epoch_collect();
+	}
+}
+
+void epoch_collect(void) {
+	// one collector is enough
+	if (pthread_mutex_trylock(&collect_mutex) != 0) {
+		return;
+	}
+
+	// the epoch may only advance if all active threads have seen the current one
+	uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	bool advance = true;
+	for(epoch_record *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record; record = record->next) {
+		if (__atomic_load_n(&record->active, __ATOMIC_SEQ_CST) && (__atomic_load_n(&record->epoch, __ATOMIC_SEQ_CST) != epoch)) {
+			advance = false;
+			break;
+		}
+	}
+	if (advance) {
+		epoch++;
+		__atomic_store_n(&global_epoch, epoch, __ATOMIC_SEQ_CST);
+	}
+
+	// take the whole retired list, free what is at least two epochs old and put the rest back
+	epoch_retired *list = __atomic_exchange_n(&retired, NULL, __ATOMIC_ACQUIRE);
+	epoch_retired *keep = NULL;
+	epoch_retired *keep_last = NULL;
+	while (list) {
+		epoch_retired *item = list;
+		list = list->next;
+
+		if (item->epoch + 2 <= epoch) {
+			item->free_fn(item->pointer);
+			free(item);
+			continue;
+		}
+
+		item->next = keep;
+		keep = item;
+		if (keep_last == NULL) {
+			keep_last = item;
+		}
+	}
+	if (keep) {
+		keep_last->next = __atomic_load_n(&retired, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&retired, &keep_last->next, keep, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			// keep_last->next has been updated, retry
+		}
+	}
+
+	pthread_mutex_unlock(&collect_mutex);
+}
@@ -0,0 +1,39 @@
+//
+//  epoch.h
+//  UnchainedSocket
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+
+#ifndef __epoch_h
+#define __epoch_h
+
+/** Function that frees retired memory */
+typedef void (*epoch_free)(void *pointer);
+
+/** Enter a read side critical section
+ *
+ * Memory that is retired while a thread is in a critical section is not freed before
+ * that thread left it, so pointers loaded from shared structures stay valid until `epoch_exit`.
+ * Critical sections may be nested, do not block in them for long.
+ */
+void epoch_enter(void);
+
+/** Leave a read side critical section */
+void epoch_exit(void);
+
+/** Retire memory that has been unlinked from all shared structures
+ *
+ * The memory is freed by one of the next `epoch_collect` calls, when no thread can hold a reference anymore.
+ * @param pointer: memory to free
+ * @param free_fn: function to free the memory with
+ */
+void epoch_retire(void *pointer, epoch_free free_fn);
+
+/** Advance the global epoch if possible and free all memory that is safe to free
+ *
+ * Called automatically from `epoch_retire` from time to time, safe to call from any thread.
+ */
+void epoch_collect(void);
+
+#endif /* __epoch_h */
@@ -9,166 +9,367 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #include <pthread.h>
 
+#include "debug.h"
 #include "queue.h"
 
+// a priority class yields one turn to a waiting lower class after this many tasks in a row
+#define QUEUE_PRIORITY_SHARE 8
+
 typedef struct _task_list {
 	work_task callback;
     cleanup cleanup;
+	expired_task expired;
 	void *data;
+	uint64_t enqueued;   // monotonic time in ms the task was queued
+	uint64_t deadline;   // monotonic time in ms the task expires, 0 for no deadline
 
 	struct _task_list *next;
 } task_list;
 
 struct _work_queue {
-	task_list *tasks;
+	task_list *tasks[QUEUE_PRIORITY_COUNT];     // one FIFO per priority class
+	task_list *last_task[QUEUE_PRIORITY_COUNT];
+	int streak[QUEUE_PRIORITY_COUNT];            // tasks run in a row per class while a lower class waited
+	int task_count;
 	pthread_mutex_t task_list_mutex;
 
-	int worker_count;
-	pthread_t *threads;
-	pthread_mutex_t barrier_mutex;
+	queue_config config;
+	int worker_count;    // running worker threads
+	int idle_workers;    // worker threads waiting for work
 	pthread_cond_t barrier;
+	pthread_cond_t exited;
+
+	pthread_t monitor_thread; // checks the age of queued tasks while all workers are busy
+	pthread_cond_t monitor;
+	bool has_monitor;
+	bool monitor_sleeping;    // waiting for the first task, has to be signalled
 
 	bool suspended;
 	bool quit;
 };
 
 void *thread_start(void *data);
+void *monitor_start(void *data);
+
+static bool queue_spawn_worker(work_queue q);
+static void queue_scale_up(work_queue q);
+static uint64_t queue_now(void);
+static void queue_deadline(struct timespec *ts, uint64_t delay_ms);
+
+void queue_config_init(queue_config *config, int min_workers, int max_workers) {
+	config->min_workers = min_workers;
+	config->max_workers = (max_workers < min_workers) ? min_workers : max_workers;
+	config->scale_up_backlog = 1;
+	config->scale_up_age_ms = 10;
+	config->idle_timeout_ms = 30000;
+	config->on_resize = NULL;
+	config->user_data = NULL;
+}
 
 work_queue queue_create(int worker_count) {
+	queue_config config;
+	queue_config_init(&config, worker_count, worker_count);
+	return queue_create_elastic(&config);
+}
+
+work_queue queue_create_elastic(const queue_config *config) {
 	work_queue q = calloc(sizeof(struct _work_queue), 1);
-	
-	q->worker_count = worker_count;
-	q->suspended    = true;
+
+	q->config    = *config;
+	q->suspended = true;
+	if (q->config.max_workers < q->config.min_workers) {
+		q->config.max_workers = q->config.min_workers;
+	}
 
 	// setup worker barrier
 	pthread_mutex_init(&q->task_list_mutex, NULL);
-	pthread_mutex_init(&q->barrier_mutex, NULL);
 	pthread_cond_init(&q->barrier, NULL);
+	pthread_cond_init(&q->exited, NULL);
+	pthread_cond_init(&q->monitor, NULL);
 
-	// Create worker threads
-	pthread_t *threads = calloc(sizeof(pthread_t), worker_count);
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-
-	for(int i = 0; i < worker_count; i++) {
-		if (pthread_create(threads + i, &attr, thread_start, q) != 0) {
+	// Create minimum number of worker threads
+	pthread_mutex_lock(&q->task_list_mutex);
+	for(int i = 0; i < q->config.min_workers; i++) {
+		if (!queue_spawn_worker(q)) {
 			abort();
 		}
 	}
-	pthread_attr_destroy(&attr);
+
+	// blocked workers never see their backlog age, somebody else has to watch it
+	if ((q->config.max_workers > q->config.min_workers) && (q->config.scale_up_age_ms > 0)) {
+		q->has_monitor = (pthread_create(&q->monitor_thread, NULL, monitor_start, q) == 0);
+		if (!q->has_monitor) {
+			DebugLog("[QUEUE] Could not start monitor\n");
+		}
+	}
+	pthread_mutex_unlock(&q->task_list_mutex);
 
 	return q;
 }
 
 void queue_free(work_queue queue) {
+    pthread_mutex_lock(&queue->task_list_mutex);
+
 	// suspend the queue
     queue->suspended = true;
 
     // signal all threads to exit
     queue->quit = true;
     pthread_cond_broadcast(&queue->barrier);
+    pthread_cond_signal(&queue->monitor);
 
     // call cleanup functions for all queued tasks
-    pthread_mutex_lock(&queue->task_list_mutex);
-    task_list *t = queue->tasks;
-    while (t->next != NULL) {
-        t->cleanup(t->data);
-        t = t->next;
+    for(int i = 0; i < QUEUE_PRIORITY_COUNT; i++) {
+        task_list *t = queue->tasks[i];
+        while (t != NULL) {
+            task_list *next = t->next;
+            t->cleanup(t->data);
+            free(t);
+            t = next;
+        }
+        queue->tasks[i] = NULL;
+        queue->last_task[i] = NULL;
     }
-    pthread_mutex_unlock(&queue->task_list_mutex);
-    
+    queue->task_count = 0;
+
 	// wait for all threads to finish
-	for(int i = 0; i < queue->worker_count; i++) {
-		pthread_join(queue->threads[i], NULL);
+	while (queue->worker_count > 0) {
+		pthread_cond_wait(&queue->exited, &queue->task_list_mutex);
+	}
+    pthread_mutex_unlock(&queue->task_list_mutex);
+	if (queue->has_monitor) {
+		pthread_join(queue->monitor_thread, NULL);
 	}
 
 	// clean up handle
+	pthread_cond_destroy(&queue->monitor);
+	pthread_cond_destroy(&queue->exited);
 	pthread_cond_destroy(&queue->barrier);
-	pthread_mutex_destroy(&queue->barrier_mutex);
 	pthread_mutex_destroy(&queue->task_list_mutex);
-	free(queue->threads);
 	free(queue);
 }
 
 void queue_resume(work_queue queue) {
+	pthread_mutex_lock(&queue->task_list_mutex);
 	if (queue->suspended) {
 		// resume work, wake all threads
 		queue->suspended = false;
 		pthread_cond_broadcast(&queue->barrier);
+		pthread_cond_signal(&queue->monitor);
 	}
+	pthread_mutex_unlock(&queue->task_list_mutex);
 }
 
 void queue_suspend(work_queue queue) {
 	// signal threads to sleep
+	pthread_mutex_lock(&queue->task_list_mutex);
 	queue->suspended = true;
+	pthread_mutex_unlock(&queue->task_list_mutex);
 }
 
 int queue_taskcount(work_queue queue) {
 	pthread_mutex_lock(&queue->task_list_mutex);
+	int count = queue->task_count;
+	pthread_mutex_unlock(&queue->task_list_mutex);
+	return count;
+}
 
-	// count items in task list
-	int i = 1;
-	task_list *task = queue->tasks;
-	while ((task = task->next)) {
-		i++;
-	}
-	
+int queue_workercount(work_queue queue) {
+	pthread_mutex_lock(&queue->task_list_mutex);
+	int count = queue->worker_count;
 	pthread_mutex_unlock(&queue->task_list_mutex);
-	return i;
+	return count;
 }
 
 void queue_add_task(work_queue queue, work_task task, cleanup clean, void *data) {
-	pthread_mutex_lock(&queue->task_list_mutex);
+	queue_add_task_ex(queue, task, clean, data, QUEUE_PRIORITY_NORMAL, 0, NULL);
+}
 
+void queue_add_task_ex(work_queue queue, work_task task, cleanup clean, void *data, queue_priority priority, int deadline_ms, expired_task expired) {
+	if ((priority < 0) || (priority >= QUEUE_PRIORITY_COUNT)) {
+		priority = QUEUE_PRIORITY_NORMAL;
+	}
 
 	// create new item
 	task_list *new_task = calloc(sizeof(task_list), 1);
 	new_task->callback = task;
     new_task->cleanup = clean;
+	new_task->expired = expired;
 	new_task->data = data;
+	new_task->enqueued = queue_now();
+	if (deadline_ms > 0) {
+		new_task->deadline = new_task->enqueued + deadline_ms;
+	}
 
-    if (queue->tasks == NULL) {
-        // queue empty
-        queue->tasks = new_task;
+	pthread_mutex_lock(&queue->task_list_mutex);
+
+    // append new task to the list of its priority class
+    if (queue->last_task[priority] == NULL) {
+        queue->tasks[priority] = new_task;
     } else {
-        // fetch last list item
-        task_list *t = queue->tasks;
-        while (t->next != NULL) {
-            t = t->next;
-        }
-        
-        // append new task
-        t->next = new_task;
+        queue->last_task[priority]->next = new_task;
     }
+    queue->last_task[priority] = new_task;
+    queue->task_count++;
 
-	// signal one thread to pick it up
-	pthread_mutex_unlock(&queue->task_list_mutex);
+	// signal one thread to pick it up, start a new one if all are busy
 	if (!queue->suspended) {
+		queue_scale_up(queue);
 		pthread_cond_signal(&queue->barrier);
+		if (queue->monitor_sleeping) {
+			pthread_cond_signal(&queue->monitor);
+		}
 	}
+	pthread_mutex_unlock(&queue->task_list_mutex);
 }
 
 //
 // Internal
 //
 
+static uint64_t queue_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// absolute realtime deadline for pthread_cond_timedwait
+static void queue_deadline(struct timespec *ts, uint64_t delay_ms) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	uint64_t deadline = (uint64_t)now.tv_sec * 1000000 + now.tv_usec + delay_ms * 1000;
+	ts->tv_sec = deadline / 1000000;
+	ts->tv_nsec = (deadline % 1000000) * 1000;
+}
+
+// call with task list locked
+static bool queue_spawn_worker(work_queue q) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int result = pthread_create(&thread, &attr, thread_start, q);
+	pthread_attr_destroy(&attr);
+
+	if (result != 0) {
+		DebugLog("[QUEUE] Could not start worker: %d\n", result);
+		return false;
+	}
+
+	q->worker_count++;
+	if (q->config.on_resize) {
+		q->config.on_resize(q, q->worker_count, q->config.user_data);
+	}
+	return true;
+}
+
+// call with task list locked
+static void queue_scale_up(work_queue q) {
+	if (q->worker_count >= q->config.max_workers) {
+		return;
+	}
+
+	// idle workers will pick up the backlog
+	if (q->task_count <= q->idle_workers) {
+		return;
+	}
+
+	// grow if the backlog is too deep or the oldest task waited too long
+	int backlog = q->task_count - q->idle_workers;
+	bool grow = (q->config.scale_up_backlog > 0) && (backlog >= q->config.scale_up_backlog);
+	if (!grow && (q->config.scale_up_age_ms > 0)) {
+		uint64_t now = queue_now();
+		for(int i = 0; i < QUEUE_PRIORITY_COUNT; i++) {
+			if (q->tasks[i] && (now - q->tasks[i]->enqueued >= (uint64_t)q->config.scale_up_age_ms)) {
+				grow = true;
+				break;
+			}
+		}
+	}
+
+	if (grow) {
+		DebugLog("[QUEUE] Backlog of %d tasks, starting worker %d\n", q->task_count, q->worker_count + 1);
+		queue_spawn_worker(q);
+	}
+}
+
 static task_list *queue_fetch_task(work_queue q) {
 	// aquire lock
 	pthread_mutex_lock(&q->task_list_mutex);
 
-	// if task list is empty return NULL
-	if (q->tasks == NULL) {
+	// sleep while the queue is suspended or empty
+	bool idle = false;
+	while (!q->quit && (q->suspended || (q->task_count == 0))) {
+		q->idle_workers++;
+		int result;
+		if ((q->worker_count > q->config.min_workers) && (q->config.idle_timeout_ms > 0)) {
+			// surplus worker, only wait until the idle timeout hits
+			struct timespec ts;
+			queue_deadline(&ts, q->config.idle_timeout_ms);
+			result = pthread_cond_timedwait(&q->barrier, &q->task_list_mutex, &ts);
+		} else {
+			result = pthread_cond_wait(&q->barrier, &q->task_list_mutex);
+		}
+		q->idle_workers--;
+
+		// scale down if still idle
+		if ((result == ETIMEDOUT) && (q->task_count == 0) && (q->worker_count > q->config.min_workers)) {
+			DebugLog("[QUEUE] Worker idle, stopping worker %d\n", q->worker_count);
+			idle = true;
+			break;
+		}
+	}
+
+	// quit signal or idle timeout, return NULL
+	if (q->quit || idle) {
+		q->worker_count--;
+		if (!q->quit && q->config.on_resize) {
+			q->config.on_resize(q, q->worker_count, q->config.user_data);
+		}
+		pthread_cond_signal(&q->exited);
 		pthread_mutex_unlock(&q->task_list_mutex);
 		return NULL;
 	}
 
-	// fetch a task from the queue
-	task_list *task = q->tasks;
-	q->tasks = q->tasks->next;
+	// fetch a task from the highest priority class that has work queued, but let a
+	// waiting lower class have a turn now and then so it does not starve
+	int priority = 0;
+	while (q->tasks[priority] == NULL) {
+		priority++;
+	}
+	while (42) {
+		int lower = priority + 1;
+		while ((lower < QUEUE_PRIORITY_COUNT) && (q->tasks[lower] == NULL)) {
+			lower++;
+		}
+		if (lower == QUEUE_PRIORITY_COUNT) {
+			// nothing waits below
+			q->streak[priority] = 0;
+			break;
+		}
+		if (q->streak[priority] < QUEUE_PRIORITY_SHARE) {
+			q->streak[priority]++;
+			break;
+		}
+		q->streak[priority] = 0;
+		priority = lower;
+	}
+	task_list *task = q->tasks[priority];
+	q->tasks[priority] = task->next;
+	if (q->tasks[priority] == NULL) {
+		q->last_task[priority] = NULL;
+	}
+	q->task_count--;
 	task->next = NULL;
 
+	// the remaining tasks may have waited too long already
+	queue_scale_up(q);
+
 	// unlock mutex and return task
 	pthread_mutex_unlock(&q->task_list_mutex);
 	return task;
@@ -178,25 +379,63 @@ void *thread_start(void *data) {
 	work_queue q = (work_queue)data;
 
 	while (42) {
-		// quit signal, join main thread
-		if (q->quit) {
+		// fetch work from task list, blocks until there is something to do
+		task_list *task = queue_fetch_task(q);
+		if (task == NULL) {
+			// quit signal or idle, stop this worker
 			pthread_exit(NULL);
 		}
 
-		// if queue is suspended sleep immediately
-		if (q->suspended) {
-			pthread_cond_wait(&q->barrier, &q->barrier_mutex);
+		// run the callback (or the expiry handler if the task missed its deadline) and free the task
+		if (task->deadline && (queue_now() > task->deadline)) {
+			DebugLog("[QUEUE] Task expired %d ms ago\n", (int)(queue_now() - task->deadline));
+			if (task->expired) {
+				task->expired(task->data);
+			}
+		} else {
+			task->callback(task->data);
 		}
+		task->cleanup(task->data);
+		free(task);
+	}
+}
 
-		// fetch work from task list, run the callback and free the task
-		task_list *task = queue_fetch_task(q);
-		if (task) {
-			task->callback(task->data);
-            task->cleanup(task->data);
-			free(task);
-		} else { 
-			// queue empty go to sleep
-			pthread_cond_wait(&q->barrier, &q->barrier_mutex);
+void *monitor_start(void *data) {
+	work_queue q = (work_queue)data;
+
+	pthread_mutex_lock(&q->task_list_mutex);
+	while (!q->quit) {
+		// nothing to watch, sleep until a task is added
+		if (q->suspended || (q->task_count == 0) || (q->worker_count >= q->config.max_workers)) {
+			q->monitor_sleeping = true;
+			pthread_cond_wait(&q->monitor, &q->task_list_mutex);
+			q->monitor_sleeping = false;
+			continue;
 		}
+
+		// wake up when the oldest task crosses the age threshold
+		uint64_t oldest = UINT64_MAX;
+		for(int i = 0; i < QUEUE_PRIORITY_COUNT; i++) {
+			if (q->tasks[i] && (q->tasks[i]->enqueued < oldest)) {
+				oldest = q->tasks[i]->enqueued;
+			}
+		}
+		uint64_t due = oldest + q->config.scale_up_age_ms;
+		uint64_t now = queue_now();
+		if (due > now) {
+			struct timespec ts;
+			queue_deadline(&ts, due - now);
+			pthread_cond_timedwait(&q->monitor, &q->task_list_mutex, &ts);
+			continue;
+		}
+
+		// overdue, grow if nobody is idle, then give the new worker time to pick something up
+		queue_scale_up(q);
+		struct timespec ts;
+		queue_deadline(&ts, q->config.scale_up_age_ms);
+		pthread_cond_timedwait(&q->monitor, &q->task_list_mutex, &ts);
 	}
+	pthread_mutex_unlock(&q->task_list_mutex);
+
+	return NULL;
 }
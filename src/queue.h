@@ -18,6 +18,48 @@ typedef void (*cleanup)(void *data);
 /** Worker callback function pointer type */
 typedef void (*work_task)(void *data);
 
+/** Expiry callback, called instead of the worker callback when a task missed its deadline */
+typedef void (*expired_task)(void *data);
+
+/** Task priority classes, higher classes run first
+ *
+ * While a higher class keeps the workers busy every 9th task is taken from the next lower class
+ * that has work queued, so bulk work is slowed down but never starved.
+ */
+typedef enum _queue_priority {
+	QUEUE_PRIORITY_HIGH = 0, /**< latency critical work */
+	QUEUE_PRIORITY_NORMAL,   /**< default priority */
+	QUEUE_PRIORITY_LOW,      /**< bulk work */
+
+	QUEUE_PRIORITY_COUNT     /**< number of priority classes */
+} queue_priority;
+
+/** Resize callback, called with the queue locked whenever a worker thread is started or stopped
+ *
+ * @attention do not call any queue functions from this callback
+ */
+typedef void (*queue_resize_callback)(work_queue queue, int worker_count, void *user_data);
+
+/** Elastic worker pool configuration */
+typedef struct _queue_config {
+	int min_workers;      /**< worker threads that are always kept running */
+	int max_workers;      /**< maximum parallel worker threads */
+	int scale_up_backlog; /**< start a worker when this many tasks wait without an idle worker (0 to disable) */
+	int scale_up_age_ms;  /**< start a worker when the oldest task waited this long (0 to disable) */
+	int idle_timeout_ms;  /**< stop workers above `min_workers` after being idle this long (0 to disable) */
+
+	queue_resize_callback on_resize; /**< optional resize monitoring callback */
+	void *user_data;                 /**< user data given to the resize callback verbatim */
+} queue_config;
+
+/** Initialize a worker pool configuration with default scaling thresholds
+ *
+ * @param config: configuration to initialize
+ * @param min_workers: worker threads that are always kept running
+ * @param max_workers: maximum parallel worker threads
+ */
+void queue_config_init(queue_config *config, int min_workers, int max_workers);
+
 /** Create a new work queue
  *
  * A new queue starts in suspended state, so don't forget to resume
@@ -26,6 +68,18 @@ typedef void (*work_task)(void *data);
  */
 work_queue queue_create(int worker_count);
 
+/** Create a new work queue with an elastic worker pool
+ *
+ * The pool starts with `min_workers` threads, grows up to `max_workers` when the backlog
+ * or the age of the oldest task crosses the configured thresholds and shrinks back after
+ * workers have been idle for `idle_timeout_ms`. The task age is watched by a monitor thread,
+ * so the pool grows even if all workers are blocked and no new tasks arrive.
+ * A new queue starts in suspended state, so don't forget to resume
+ * @param config: worker pool configuration, copied
+ * @return new work queue handle
+ */
+work_queue queue_create_elastic(const queue_config *config);
+
 /** Free a work queue
  *
  * Freeing is only possible if there are no tasks queued.
@@ -54,6 +108,13 @@ void queue_suspend(work_queue queue);
  */
 int queue_taskcount(work_queue queue);
 
+/** Fetch number of currently running worker threads
+ *
+ * @param queue: The queue to query
+ * @returns number of worker threads
+ */
+int queue_workercount(work_queue queue);
+
 /** Add task to queue
  *
  * @attention the task has to manage the memory it gets with the data pointer!
@@ -63,4 +124,17 @@ int queue_taskcount(work_queue queue);
  */
 void queue_add_task(work_queue queue, work_task task, cleanup clean, void *data);
 
+/** Add task with priority and deadline to queue
+ *
+ * @attention the task has to manage the memory it gets with the data pointer!
+ * @param queue: The queue to add to
+ * @param task: callback
+ * @param clean: cleanup function, always called after the callback or expiry handler
+ * @param data: data to send to the callback
+ * @param priority: priority class of the task
+ * @param deadline_ms: drop the task if it did not start within this many milliseconds (0 for no deadline)
+ * @param expired: optional callback to run instead of `task` when the deadline was missed
+ */
+void queue_add_task_ex(work_queue queue, work_task task, cleanup clean, void *data, queue_priority priority, int deadline_ms, expired_task expired);
+
 #endif /* __queue_h */
@@ -17,95 +17,361 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <pthread.h>
+#include <signal.h>
 
 // for sendfile
-#if defined(__APPLE__) && defined(__MACH__)
-#include <sys/uio.h>
-#else
+#if !defined(__APPLE__) || !defined(__MACH__)
 #include <sys/sendfile.h>
 #endif
 
+// macOS has no MSG_NOSIGNAL, SO_NOSIGPIPE is set on the sockets instead
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
 #include "debug.h"
 #include "server.h"
 #include "queue.h"
+#include "epoch.h"
+#include "capture.h"
+#include "shm.h"
+#include "shm_private.h"
 
 // server handle definition
 struct _ServerHandle {
     // user settings
     ReceiveCallback onReceive;  // receive callback function
+    AsyncReceiveCallback onReceiveAsync; // async receive callback function, used instead of onReceive if set
+    BatchReceiveCallback onReceiveBatch; // batch receive callback function, used instead of onReceive if set
+    int batchSize;              // maximum number of messages per batch
 	void *userData;				// user data given to the data callback verbatim
     int timeout;                // socket read timeout
+    queue_priority acceptPriority; // priority new connections are tagged with
+    int readDeadline;           // drop reads that waited longer than this (ms)
+    ExpiredCallback onExpired;  // called for dropped reads
+
+    // read scheduling
+    int readQuantum;            // bytes a connection may read per turn
+    int readMessages;           // receive callbacks a connection may get per turn
+    int rateLimit;              // bytes per second, 0 for no rate limit
+    int rateBurst;              // token bucket size in bytes
+    bool rateLimitPerIP;        // share one token bucket between connections of the same remote IP
+    pthread_mutex_t rateLimitMutex;
+    struct _RateLimit **rateLimits;
+    int numRateLimits;
 
     // socket specific
     int socket;                 // socket fd
+    int backlog;                // listen queue length
+    int deferAccept;            // TCP_DEFER_ACCEPT timeout in seconds, 0 to disable
+    int fastOpen;               // TCP_FASTOPEN queue length, 0 to disable
+    SocketOptions socketOptions; // options applied to the listener, accepted connections inherit them
+    bool hasSocketOptions;      // at least one socket option differs from the system default
+    int busyPoll;               // microseconds to spin before sleeping in select, 0 to dispatch to workers
+    int busyPollSocket;         // SO_BUSY_POLL microseconds for accepted connections
     pthread_t socketListener;   // listener thread
     int signalPipe[2];             // pipe to wake select thread
+    bool accepting;             // listening socket is part of the select set
+    uint64_t listenerPasses;    // select loop iterations, used to wait for the listener to see a change
+    bool draining;              // do not dispatch new reads, connections are about to be closed or handed over
+    int handoverChannel;        // predecessor is still handing over connections, -1 if not. Only used by the listener
+    bool quit;                  // listener thread should exit
 
     // connections
-    pthread_mutex_t connectionMutex;
-    Connection **connections;
+    struct connectionTable *connections; // slots change in place, replaced when growing, only read inside an epoch
+    pthread_mutex_t connectionMutex; // serializes adding and removing, readers never take it
     int numConnections;
-    int allocatedConnections;
+    int pendingCloses;          // closed connections the listener still has to unlink
+    int usedSlots;              // connections and tombstones in the current table
+    Connection **readyConnections; // scratch list of readable connections, only used by the listener
+    int allocatedReadyConnections;
     int connectionID;
 
+    // limits and accounting
+    int maxConnections;         // close new connections above this, 0 for no limit
+    int softConnections;        // shed idle connections above this, 0 to disable
+    int maxQueuedTasks;         // do not start reads while this many are queued, 0 for no limit
+    size_t maxBufferedBytes;    // send queue budget of all connections, 0 for no limit
+    size_t bufferedBytes;       // data in all send queues
+    uint64_t accepted;
+    uint64_t rejectedConnections;
+    uint64_t shedConnections;
+    uint64_t deferredReads;
+    uint64_t rejectedSends;
+
+    // traffic capture, NULL if disabled
+    capture_log capture;
+
+    // shared memory transport
+    int shmSocket;              // unix socket clients negotiate channels on, -1 if disabled
+    char *shmPath;
+    size_t shmRingSize;
+
+    // broadcast groups
+    pthread_mutex_t groupMutex;
+    struct _Group **groups;     // open addressing by name hash, groups are never removed
+    int groupCapacity;          // power of two
+    int numGroups;
+
     // worker queue
     work_queue queue;
 };
 
+// Connection table, open addressing keyed by connection ID. Slots are updated in place,
+// the table is only replaced (and the old one retired) when it has to grow
+#define CONNECTION_TABLE_MIN 64
+
+struct connectionTable {
+    int capacity;               // power of two
+    Connection *slots[];
+};
+
+static Connection connectionTombstone;  // marks removed entries, probing continues past them
+
 // listener thread
 void *listener(void *data);
 
 // Internal action functions
 static void accept_connection(ServerHandle handle);
+static void accept_shm_connection(ServerHandle handle);
+static bool admit_connection(ServerHandle handle, int fd);
+static ssize_t connection_read(Connection *connection, char *buffer, size_t len);
+static void add_connection(ServerHandle handle, Connection *connection);
+static bool remove_connection(ServerHandle handle, Connection *connection);
 static void close_idle_connections(ServerHandle handle);
+static bool shed_idle_connection(ServerHandle handle);
+static int connection_count(ServerHandle handle);
+static struct connectionTable *connection_table_create(int capacity);
+static Connection *connection_at(struct connectionTable *table, int index);
+static Connection *find_connection(ServerHandle handle, int id);
 static void close_connection(ServerHandle handle, Connection *connection);
+static void destroy_connection(ServerHandle handle, Connection *connection);
+static void reap_connections(ServerHandle handle);
+static void free_connection(void *data);
+static bool begin_receive(Connection *connection);
+static bool end_receive(ServerHandle handle, Connection *connection);
 static void read_data(ServerHandle handle, fd_set readable);
+static void wake_listener(ServerHandle handle);
+static void wait_for_readers(ServerHandle handle, int timeout);
+static void expire_requests(ServerHandle handle);
+static bool finish_request(ServerHandle handle, Connection *connection, uint32_t request, bool keepConnection);
+static void wait_for_senders(ServerHandle handle, int timeout);
+static void stop_accepting(ServerHandle handle);
+static void wait_for_listener(ServerHandle handle);
+
+// Handover protocol
+#define HANDOVER_MAGIC 0x554e4348 /* 'UNCH' */
+
+enum handoverType {
+    HANDOVER_LISTENER = 1,
+    HANDOVER_CONNECTION,
+    HANDOVER_DONE
+};
+
+struct handoverRecord {
+    uint32_t magic;
+    uint32_t type;
+    int32_t id;
+    int32_t remotePort;
+    char remoteIP[46];
+};
+
+static bool handover_send(int channel, struct handoverRecord *record, int fd);
+static int handover_receive(int channel, struct handoverRecord *record);
+static void receive_handover(ServerHandle handle);
 
 // read task
 struct readTaskData {
     ServerHandle handle;
     Connection *connection;
+    bool inlined;               // running on the listener thread, no need to wake it
 };
 void read_task(void *data);
+void read_expired(void *data);
 void clean_task(void *data);
 
+// batch read task
+struct batchTaskData {
+    ServerHandle handle;
+    bool inlined;
+    int count;
+    Connection *connections[];
+};
+void batch_task(void *data);
+static void dispatch_batch(ServerHandle handle, struct batchTaskData *data, queue_priority priority);
+void batch_expired(void *data);
+
+// Send queues
+#define SEND_IOV_MAX 64
+
+struct _SharedBuffer {
+    int references;
+    size_t length;
+    char data[];
+};
+
+struct sendItem {
+    SharedBuffer *buffer;       // NULL for files
+    int file;                   // file to send with sendfile, -1 for buffers
+    size_t offset;              // bytes of the buffer or file already sent
+    size_t length;
+};
+
+struct _SendQueue {
+    pthread_mutex_t mutex;
+    struct sendItem *items;     // ring buffer of pending sends
+    int first;
+    int count;
+    int allocated;
+    size_t queuedBytes;         // buffers and files
+    bool closed;
+    bool failed;                // the socket is broken, close the connection after unlocking
+};
+
+// members and memberships point at each other so leaving a group is a swap-remove on both sides
+struct _Member {
+    Connection *connection;
+    int membership;             // index in connection->groups
+};
+
+struct _Membership {
+    struct _Group *group;
+    int slot;                   // index in group->members
+};
+
+struct _Group {
+    char *name;
+    uint32_t hash;
+    struct _Member *members;
+    int numMembers;
+    int allocatedMembers;
+};
+
+#define GROUP_TABLE_MIN 16
+
+static bool send_enqueue(Connection *connection, SharedBuffer *buffer, bool *pending);
+static bool send_closed(Connection *connection);
+static bool send_push(Connection *connection, SharedBuffer *buffer);
+static bool send_push_file(Connection *connection, int file, size_t length);
+static struct sendItem *send_append(Connection *connection);
+static void send_pop(struct _SendQueue *queue);
+static void send_flush(Connection *connection);
+static void send_queue_clear(Connection *connection);
+static bool send_budget(Connection *connection, size_t len);
+static ssize_t send_file_chunk(int socket, int fd, off_t *offset, size_t count);
+static void write_data(ServerHandle handle, fd_set writable);
+static uint32_t group_hash(const char *name);
+static struct _Group *find_group(ServerHandle handle, const char *name);
+static struct _Group *create_group(ServerHandle handle, const char *name);
+static int find_membership(Connection *connection, struct _Group *group);
+static void group_remove(struct _Group *group, int slot);
+
+// Read scheduling
+#define READ_BUFFER_SIZE 4096
+#define OVERLOAD_BACKOFF_MS 10
+#define SHED_IDLE_DIVISOR 4 /* shed connections idle for a quarter of the timeout */
+
+struct _RateLimit {
+    char remoteIP[46];
+    int references;
+    double tokens;
+    uint64_t lastRefill;
+};
+
+static size_t rate_limit_allowance(ServerHandle handle, Connection *connection, size_t wanted, uint64_t now);
+static void rate_limit_consume(ServerHandle handle, Connection *connection, size_t bytes);
+static void release_connection(ServerHandle handle, Connection *connection);
+
 // Internal helper
 struct selectMask {
     fd_set readSet;
+    fd_set writeSet;
     int maxFD;
+    bool accepting;
+    uint64_t wakeup;    // earliest time a throttled connection may read again
 };
 
+static uint64_t now_ms(void);
+static uint64_t now_us(void);
+
 static struct selectMask build_select_mask(ServerHandle handle);
+static ServerHandle create_handle(int timeout);
+static void destroy_handle(ServerHandle handle);
+static void apply_config(ServerHandle handle, const ServerConfig *config);
+static Connection *create_connection(ServerHandle handle, int fd);
+static bool apply_socket_options(int fd, const SocketOptions *options);
+static bool has_socket_options(const SocketOptions *options);
+static void enable_busy_poll(int fd, int usec);
+static void disable_sigpipe(int fd);
+static int busy_poll(ServerHandle handle, struct selectMask *msk);
 
 /*
  * MARK: - API
  */
 
+void server_socket_options_init(SocketOptions *options) {
+    options->noDelay = -1;
+    options->receiveBuffer = -1;
+    options->sendBuffer = -1;
+    options->keepAlive = -1;
+    options->keepAliveIdle = -1;
+    options->keepAliveInterval = -1;
+    options->keepAliveCount = -1;
+    options->userTimeout = -1;
+    options->linger = -1;
+    options->notSentLowat = -1;
+}
+
+void server_config_init(ServerConfig *config, const char *listenIP, const char *port) {
+    memset(config, 0, sizeof(ServerConfig));
+    config->version = SERVER_CONFIG_VERSION;
+    config->listenIP = listenIP;
+    config->port = port;
+    config->v4Only = false;
+    config->timeout = 10;
+    config->backlog = 0;
+    config->deferAccept = 0;
+    config->fastOpen = 0;
+    config->acceptPriority = QUEUE_PRIORITY_NORMAL;
+    server_socket_options_init(&config->socketOptions);
+    config->busyPoll = 0;
+    config->busyPollSocket = 0;
+}
+
 ServerHandle server_init(const char *listenIP, const char *port, bool v4Only, int timeout) {
+    ServerConfig config;
+    server_config_init(&config, listenIP, port);
+    config.v4Only = v4Only;
+    config.timeout = timeout;
 
-    // zero initialize needed structs
-    ServerHandle handle = calloc(sizeof(struct _ServerHandle), 1);
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof(struct addrinfo));
+    return server_init_ex(&config);
+}
 
-    // initialize handle
-    handle->timeout = timeout;
-    handle->allocatedConnections = 1000;
-    handle->numConnections = 0;
-    handle->connections = calloc(1000, sizeof(Connection *));
-    if (pipe(handle->signalPipe)) {
-        free(handle);
-        DebugLog("pipe call failed: %s\n", strerror(errno));
+ServerHandle server_init_ex(const ServerConfig *config) {
+    if ((config->version < 1) || (config->version > SERVER_CONFIG_VERSION)) {
+        DebugLog("Unsupported config version: %d\n", config->version);
         return NULL;
     }
-    int flags = fcntl(handle->signalPipe[0], F_GETFL, 0);
-    fcntl(handle->signalPipe[0], F_SETFL, flags | O_NONBLOCK);
+    const char *listenIP = config->listenIP;
+    const char *port = config->port;
+    bool v4Only = config->v4Only;
 
-    pthread_mutex_init(&handle->connectionMutex, NULL);
+    // zero initialize needed structs
+    ServerHandle handle = create_handle(config->timeout);
+    if (handle == NULL) {
+        return NULL;
+    }
+    apply_config(handle, config);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(struct addrinfo));
 
     // address to listen on
     const char *address = listenIP;
@@ -127,9 +393,8 @@ ServerHandle server_init(const char *listenIP, const char *port, bool v4Only, in
 	struct addrinfo *info = NULL;
 	int result = getaddrinfo(address, port, &hints, &info);
 	if (result != 0) {
-		free(handle);
         DebugLog("getaddrinfo call failed: %s\n", gai_strerror(result));
-		return NULL;
+		goto fail;
 	}
 
     // select the best info struct (usually use IPv6)
@@ -161,47 +426,162 @@ ServerHandle server_init(const char *listenIP, const char *port, bool v4Only, in
 	handle->socket = socket(cInfo->ai_family, cInfo->ai_socktype, cInfo->ai_protocol);
 	if (handle->socket < 0) {
 		freeaddrinfo(info);
-		free(handle);
         DebugLog("socket call failed: %s\n", strerror(errno));
-		return NULL;
+		goto fail;
 	}
 
     // allow socket address reuse to avoid being blocked for two minutes after restart
     int yes = 1;
     setsockopt(handle->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
+    // apply socket options to the listener, buffer sizes have to be set before listen to be inherited
+    apply_socket_options(handle->socket, &handle->socketOptions);
+    if (handle->busyPollSocket > 0) {
+        enable_busy_poll(handle->socket, handle->busyPollSocket);
+    }
+
     // bind to the selected address
     if (bind(handle->socket, cInfo->ai_addr, cInfo->ai_addrlen)) {
         freeaddrinfo(info);
-        free(handle);
         DebugLog("bind call failed: %s\n", strerror(errno));
-        return NULL;
+        goto fail;
     }
     freeaddrinfo(info);
 
     // all ready
 	return handle;
+
+fail:
+    destroy_handle(handle);
+    return NULL;
+}
+
+ServerHandle server_init_handover(const char *path, int timeout) {
+    ServerConfig config;
+    server_config_init(&config, NULL, NULL);
+    config.timeout = timeout;
+
+    return server_init_handover_ex(path, &config);
+}
+
+ServerHandle server_init_handover_ex(const char *path, const ServerConfig *config) {
+    if ((config->version < 1) || (config->version > SERVER_CONFIG_VERSION)) {
+        DebugLog("Unsupported config version: %d\n", config->version);
+        return NULL;
+    }
+
+    // wait for the predecessor to connect
+    int listenSocket = shm_socket_listen(path, 1);
+    if (listenSocket < 0) {
+        DebugLog("[HANDOVER] Could not listen on %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    int channel;
+    do {
+        channel = accept(listenSocket, NULL, NULL);
+    } while ((channel < 0) && (errno == EINTR));
+    close(listenSocket);
+    unlink(path);
+    if (channel < 0) {
+        DebugLog("[HANDOVER] accept call failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    // first record is the listening socket
+    struct handoverRecord record;
+    int fd = handover_receive(channel, &record);
+    if ((fd < 0) || (record.type != HANDOVER_LISTENER)) {
+        DebugLog("[HANDOVER] Did not receive a listening socket\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        close(channel);
+        return NULL;
+    }
+
+    ServerHandle handle = create_handle(config->timeout);
+    if (handle == NULL) {
+        close(fd);
+        close(channel);
+        return NULL;
+    }
+    apply_config(handle, config);
+    handle->socket = fd;
+    apply_socket_options(handle->socket, &handle->socketOptions);
+    if (handle->busyPollSocket > 0) {
+        enable_busy_poll(handle->socket, handle->busyPollSocket);
+    }
+
+    // return right away so we can start accepting, the listener adopts the connections that follow
+    handle->handoverChannel = channel;
+
+    return handle;
 }
 
 bool server_start(ServerHandle handle, ReceiveCallback onReceive, void *userData, int workerCount) {
-	if (handle->onReceive) {
+    queue_config pool;
+    queue_config_init(&pool, workerCount, workerCount);
+    return server_start_pool(handle, onReceive, userData, &pool);
+}
+
+bool server_start_async(ServerHandle handle, AsyncReceiveCallback onReceive, void *userData, const queue_config *pool) {
+	if (handle->queue) {
+		// already running
+		return false;
+	}
+    handle->onReceiveAsync = onReceive;
+    return server_start_pool(handle, NULL, userData, pool);
+}
+
+bool server_start_batch(ServerHandle handle, BatchReceiveCallback onReceive, void *userData, int maxBatch, const queue_config *pool) {
+	if (handle->queue) {
+		// already running
+		return false;
+	}
+    handle->onReceiveBatch = onReceive;
+    handle->batchSize = (maxBatch > 0) ? maxBatch : 1;
+    return server_start_pool(handle, NULL, userData, pool);
+}
+
+bool server_start_pool(ServerHandle handle, ReceiveCallback onReceive, void *userData, const queue_config *pool) {
+	if (handle->queue) {
 		// already running
 		return false;
 	}
     handle->onReceive = onReceive;
-    handle->queue = queue_create(workerCount);
+    handle->queue = queue_create_elastic(pool);
 	handle->userData = userData;
     queue_resume(handle->queue);
 
+    // accept in batches until the listen queue is empty
+    int flags = fcntl(handle->socket, F_GETFL, 0);
+    fcntl(handle->socket, F_SETFL, flags | O_NONBLOCK);
+
+#if defined(TCP_DEFER_ACCEPT)
+    // only wake up when the client actually sent data
+    if (handle->deferAccept > 0) {
+        if (setsockopt(handle->socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &handle->deferAccept, sizeof(int))) {
+            DebugLog("Could not set TCP_DEFER_ACCEPT: %s\n", strerror(errno));
+        }
+    }
+#endif
+
+#if defined(TCP_FASTOPEN)
+    // allow data in the SYN packet
+    if (handle->fastOpen > 0) {
+        if (setsockopt(handle->socket, IPPROTO_TCP, TCP_FASTOPEN, &handle->fastOpen, sizeof(int))) {
+            DebugLog("Could not set TCP_FASTOPEN: %s\n", strerror(errno));
+        }
+    }
+#endif
+
     // start listening
-	int result = listen(handle->socket, 20);
+	int result = listen(handle->socket, handle->backlog);
 	if (result < 0) {
         DebugLog("listen call failed: %s\n", strerror(errno));
 		return false;
 	}
 
-    sleep(1);
-    
     // create a thread for the accept loop
     DebugLog("Starting ACCEPT thread\n");
 	pthread_create(&handle->socketListener, NULL, listener, handle);
@@ -209,328 +589,2152 @@ bool server_start(ServerHandle handle, ReceiveCallback onReceive, void *userData
 	return true;
 }
 
-void server_stop(ServerHandle handle) {
-    // close the socket
-    DebugLog("Closing socket\n");
-	close(handle->socket);
-    close(handle->signalPipe[0]);
-    close(handle->signalPipe[1]);
-
-    // wait for the accept thread to finish
-    DebugLog("Joining ACCEPT thread\n");
-	pthread_join(handle->socketListener, NULL);
-
-    // destroy the handle
-    queue_free(handle->queue);
-
-    for(int i = 0; i < handle->numConnections; i++) {
-        close_connection(handle, handle->connections[i]);
-    }
-    free(handle->connections);
+void server_set_accept_priority(ServerHandle handle, queue_priority priority) {
+    handle->acceptPriority = priority;
+}
 
-    pthread_mutex_destroy(&handle->connectionMutex);
-    handle->onReceive = NULL;
-	free(handle);
+void server_set_read_deadline(ServerHandle handle, int deadline, ExpiredCallback onExpired) {
+    handle->readDeadline = deadline;
+    handle->onExpired = onExpired;
 }
 
-void server_send_data(Connection *connection, const char *data, size_t len) {
-    connection->sending = true;
+void server_set_read_budget(ServerHandle handle, int quantum, int maxMessages) {
+    handle->readQuantum = (quantum > 0) ? quantum : READ_BUFFER_SIZE;
+    handle->readMessages = (maxMessages > 0) ? maxMessages : 1;
+}
 
-    size_t bytesWritten = 0;
-    while (bytesWritten < len) {
-        // Try to send the data
-        ssize_t result = write(connection->fd, data + bytesWritten, len - bytesWritten);
-        if (result < 0) {
-            // error occured, check if it was recoverable
-            if (errno == EINTR) {
-                continue;
-            }
+void server_set_rate_limit(ServerHandle handle, int bytesPerSecond, int burst, bool perIP) {
+    pthread_mutex_lock(&handle->rateLimitMutex);
+    handle->rateLimit = bytesPerSecond;
+    handle->rateBurst = (burst > 0) ? burst : bytesPerSecond;
+    handle->rateLimitPerIP = perIP;
+    pthread_mutex_unlock(&handle->rateLimitMutex);
+}
 
-            if (errno == EAGAIN) {
-                // TODO: select on fd until writable instead of spinning
-                continue;
-            }
+void server_set_listen_options(ServerHandle handle, int backlog, int deferAccept, int fastOpen) {
+    handle->backlog = (backlog > 0) ? backlog : SOMAXCONN;
+    handle->deferAccept = deferAccept;
+    handle->fastOpen = fastOpen;
+}
 
-            // not recoverable
-            DebugLog("[SEND:%d] Could not send data: %s\n", connection->id, strerror(errno));
-            break;
-        }
+void server_set_limits(ServerHandle handle, int maxConnections, int softConnections, int maxQueuedTasks, size_t maxBufferedBytes) {
+    handle->maxConnections = (maxConnections > 0) ? maxConnections : 0;
+    handle->softConnections = (softConnections > 0) ? softConnections : 0;
+    handle->maxQueuedTasks = (maxQueuedTasks > 0) ? maxQueuedTasks : 0;
+    handle->maxBufferedBytes = maxBufferedBytes;
+}
 
-        bytesWritten += result;
+bool server_set_capture(ServerHandle handle, const char *path, size_t maxSize, size_t snapLength) {
+    if (handle->queue || handle->capture) {
+        // already running or capturing
+        return false;
     }
-    connection->sending = false;
+    handle->capture = capture_open(path, maxSize, snapLength);
+    return (handle->capture != NULL);
 }
 
-void server_send_file(Connection *connection, const char *filename) {
-    // open filne
-    int fd = open(filename, O_RDONLY);
+bool server_enable_shm(ServerHandle handle, const char *path, size_t ringSize) {
+#if defined(__linux__)
+    if (handle->queue || (handle->shmSocket >= 0)) {
+        // already running or enabled
+        return false;
+    }
+
+    int fd = shm_socket_listen(path, handle->backlog);
     if (fd < 0) {
-        DebugLog("[SEND:%d] Could not open file: %s\n", connection->id, strerror(errno));
-        return;
+        DebugLog("[SHM] Could not listen on %s: %s\n", path, strerror(errno));
+        return false;
     }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 
-    // fetch file size
-    struct stat st;
-    memset(&st, 0, sizeof(struct stat));
-    fstat(fd, &st);
-    size_t fileSize = st.st_size;
+    handle->shmSocket = fd;
+    handle->shmPath = strdup(path);
+    handle->shmRingSize = ringSize;
+    return true;
+#else
+    DebugLog("[SHM] Shared memory transport is only available on Linux\n");
+    return false;
+#endif
+}
 
+void server_get_stats(ServerHandle handle, ServerStats *stats) {
+    memset(stats, 0, sizeof(ServerStats));
+    stats->connections = connection_count(handle);
+    if (handle->queue) {
+        stats->queuedTasks = queue_taskcount(handle->queue);
+        stats->workers = queue_workercount(handle->queue);
+    }
+    stats->bufferedBytes = __atomic_load_n(&handle->bufferedBytes, __ATOMIC_RELAXED);
+    stats->accepted = __atomic_load_n(&handle->accepted, __ATOMIC_RELAXED);
+    stats->rejectedConnections = __atomic_load_n(&handle->rejectedConnections, __ATOMIC_RELAXED);
+    stats->shedConnections = __atomic_load_n(&handle->shedConnections, __ATOMIC_RELAXED);
+    stats->deferredReads = __atomic_load_n(&handle->deferredReads, __ATOMIC_RELAXED);
+    stats->rejectedSends = __atomic_load_n(&handle->rejectedSends, __ATOMIC_RELAXED);
+}
 
-    // send file by using OS specific sendfile implementation
-    connection->sending = true;
-    off_t size = 0;
-    off_t bytesWritten = 0;
-#if defined(__APPLE__) && defined(__MACH__)
+int server_worker_count(ServerHandle handle) {
+    if (handle->queue == NULL) {
+        return 0;
+    }
+    return queue_workercount(handle->queue);
+}
 
-    // OSX way of sending a file
-    while (bytesWritten < fileSize) {
-        if (sendfile(fd, connection->fd, bytesWritten, &size, NULL, 0)) {
+void server_stop(ServerHandle handle) {
+    // signal the accept thread to quit and wait for it to finish
+    DebugLog("Joining ACCEPT thread\n");
+    handle->quit = true;
+    wake_listener(handle);
+	pthread_join(handle->socketListener, NULL);
 
-            // buffer full?
-            if (errno == EAGAIN) {
-                bytesWritten += size;
-                size = 0;
-                // TODO: select on the fd until writable again instead of spinning
-                continue;
-            }
+    // close the socket
+    DebugLog("Closing socket\n");
+    if (handle->socket >= 0) {
+        close(handle->socket);
+    }
+    if (handle->shmSocket >= 0) {
+        close(handle->shmSocket);
+        unlink(handle->shmPath);
+        free(handle->shmPath);
+    }
+    if (handle->handoverChannel >= 0) {
+        close(handle->handoverChannel);
+    }
 
-            // unrecoverable error
-            DebugLog("[SEND:%d] Could not send file: %s\n", connection->id, strerror(errno));
-            break;
+    // destroy the handle
+    queue_free(handle->queue);
+
+    // no reader is left running, dropped read tasks did not get to clear their flag
+    epoch_enter();
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection) {
+            __atomic_fetch_or(&connection->state, CONNECTION_CLOSED, __ATOMIC_SEQ_CST);
+            destroy_connection(handle, connection);
         }
     }
-#else
-
-    // Linux way of sending a file
-    while (bytesWritten < fileSize) {
-        ssize_t result = sendfile(connection->fd, fd, &bytesWritten, fileSize - bytesWritten);
+    epoch_exit();
+    free(__atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE));
 
-        if ((result < 0) && (errno != EAGAIN)) {
-            // unrecoverable error
-            DebugLog("[SEND:%d] Could not send file: %s\n", connection->id, strerror(errno));
-            break;
+    // the listener and all workers are gone, free what has been retired so far
+    for(int i = 0; i < 3; i++) {
+        epoch_collect();
+    }
+    free(handle->rateLimits);
+    free(handle->readyConnections);
+    for(int i = 0; i < handle->groupCapacity; i++) {
+        if (handle->groups[i]) {
+            free(handle->groups[i]->name);
+            free(handle->groups[i]->members);
+            free(handle->groups[i]);
         }
+    }
+    free(handle->groups);
 
-        // TODO: select on the fd until writable again instead of spinning
+    if (handle->capture) {
+        capture_close(handle->capture);
     }
-#endif
-    connection->sending = false;
 
-    // finished, close file
-    close(fd);
+    // late closes from workers still poke the listener, so the pipe goes last
+    close(handle->signalPipe[0]);
+    close(handle->signalPipe[1]);
+    pthread_mutex_destroy(&handle->groupMutex);
+    pthread_mutex_destroy(&handle->rateLimitMutex);
+    pthread_mutex_destroy(&handle->connectionMutex);
+    handle->onReceive = NULL;
+	free(handle);
 }
 
+void server_drain(ServerHandle handle) {
+    // stop accepting new connections and stop dispatching reads
+    DebugLog("[DRAIN] Stop accepting\n");
+    stop_accepting(handle);
+    __atomic_store_n(&handle->draining, true, __ATOMIC_SEQ_CST);
+    wake_listener(handle);
+
+    // let in-flight reads finish and queued data go out, then close everything
+    wait_for_readers(handle, handle->timeout);
+    wait_for_senders(handle, handle->timeout);
+    epoch_enter();
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    DebugLog("[DRAIN] Closing %d connections\n", connection_count(handle));
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection) {
+            close_connection(handle, connection);
+        }
+    }
+    epoch_exit();
 
-/*
- * MARK: - Accept thread
- */
+    // the listener unlinks them, the pass that is running may have missed the closes but the next one reaps them
+    if (handle->queue) {
+        wait_for_listener(handle);
+        wait_for_listener(handle);
+    }
+}
 
-void *listener(void *data) {
-	ServerHandle handle = (ServerHandle)data;
+bool server_handover(ServerHandle handle, const char *path, bool includeConnections) {
+    // connect to the successor
+    int channel = shm_socket_connect(path);
+    if (channel < 0) {
+        DebugLog("[HANDOVER] Could not connect to %s: %s\n", path, strerror(errno));
+        return false;
+    }
 
-    // prepare timeout
-    struct timeval tv;
-    memset(&tv, 0, sizeof(struct timeval));
+    // send the listening socket first, we keep accepting until the successor has it
+    struct handoverRecord record;
+    memset(&record, 0, sizeof(struct handoverRecord));
+    record.type = HANDOVER_LISTENER;
+    if (!handover_send(channel, &record, handle->socket)) {
+        close(channel);
+        return false;
+    }
 
-    DebugLog("[Listener thread] Hello\n");
+    // the successor returns from server_init_handover and accepts from the shared listen queue,
+    // connections we accepted until now are handed over with the rest
+    stop_accepting(handle);
+    DebugLog("[HANDOVER] Listener handed over, draining\n");
+    __atomic_store_n(&handle->draining, true, __ATOMIC_SEQ_CST);
+    wake_listener(handle);
+    wait_for_readers(handle, handle->timeout);
+    wait_for_senders(handle, handle->timeout);
+
+    // hand over or close all remaining connections
+    bool success = true;
+    epoch_enter();
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection == NULL) {
+            continue;
+        }
 
-    // select loop
-	while (42) {
-        // reset timeout as linux rewrites it with the unused time
-        tv.tv_sec = handle->timeout;
+        // shared memory channels can not be handed over, those clients have to reconnect.
+        // Neither can connections with unsent data, the successor would continue a truncated stream
+        bool flushed = (__atomic_load_n(&connection->sendQueue->queuedBytes, __ATOMIC_RELAXED) == 0);
+        if (includeConnections && success && flushed && !connection->shm) {
+            memset(&record, 0, sizeof(struct handoverRecord));
+            record.type = HANDOVER_CONNECTION;
+            record.id = connection->id;
+            record.remotePort = connection->remotePort;
+            if (connection->remoteIP) {
+                strncpy(record.remoteIP, connection->remoteIP, sizeof(record.remoteIP) - 1);
+            }
+            success = handover_send(channel, &record, connection->fd);
+        }
+        close_connection(handle, connection);
+    }
+    epoch_exit();
 
-        // select on all open connections until someone has something to read
-        struct selectMask msk = build_select_mask(handle);
-        int result = select(msk.maxFD + 1, &msk.readSet, NULL, NULL, &tv);
+    // finish the handover
+    if (success) {
+        memset(&record, 0, sizeof(struct handoverRecord));
+        record.type = HANDOVER_DONE;
+        success = handover_send(channel, &record, -1);
+    }
+    close(channel);
 
-        if (result == 0) {
-            // timeout, kick all open connections that are not sending currently
-            close_idle_connections(handle);
-        } else if ((result < 0) && (errno != EINTR) && (errno != EBADF)) {
-            DebugLog("[Listener thread] Error in select: %s\n", strerror(errno));
-            pthread_exit(NULL);
-        }
+    // our copy of the listening socket is not needed anymore
+    close(handle->socket);
+    handle->socket = -1;
 
-        // Clear signal pipe
-        if (FD_ISSET(handle->signalPipe[0], &msk.readSet)) {
-            DebugLog("[Listener thread] Woken up by signal pipe\n");
-            char buf[1000];
-            read(handle->signalPipe[0], buf, 1000);
-        }
+    return success;
+}
 
-        // Check if we can accept a connection
-        if (FD_ISSET(handle->socket, &msk.readSet)) {
-            accept_connection(handle);
-        }
+SharedBuffer *server_buffer_create(const char *data, size_t len) {
+    SharedBuffer *buffer = malloc(sizeof(SharedBuffer) + len);
+    buffer->references = 1;
+    buffer->length = len;
+    memcpy(buffer->data, data, len);
+    return buffer;
+}
 
-        // check all open connections and start read threads
-        if (result > 0) {
-            read_data(handle, msk.readSet);
-        }
-    }
+SharedBuffer *server_buffer_retain(SharedBuffer *buffer) {
+    __atomic_add_fetch(&buffer->references, 1, __ATOMIC_RELAXED);
+    return buffer;
 }
 
-static void accept_connection(ServerHandle handle) {
-    // zero out the remote address struct
-    struct sockaddr_storage remoteAddr;
-    memset(&remoteAddr, 0, sizeof(struct sockaddr_storage));
-
-    // wait for a client to connect
-    DebugLog("[ACCEPT] Waiting for connection\n");
-    socklen_t len = sizeof(struct sockaddr_storage);
-    int fd;
-    do {
-        fd = accept(handle->socket, (struct sockaddr *)&remoteAddr, &len);
+void server_buffer_release(SharedBuffer *buffer) {
+    if (__atomic_sub_fetch(&buffer->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(buffer);
+    }
+}
 
-        // if some error happened determine if it is recoverable
-        if ((fd < 0) && (errno != EINTR)) {
-            // unknown error die now
-            DebugLog("[ACCEPT] Error while accept: %s\n", strerror(errno));
-            return;
+int server_broadcast(ServerHandle handle, SharedBuffer *buffer, Connection **connections, int count) {
+    int queued = 0;
+    bool wake = false;
+    for(int i = 0; i < count; i++) {
+        bool pending = false;
+        if (send_enqueue(connections[i], buffer, &pending)) {
+            queued++;
         }
-    } while (fd < 0);
+        wake |= pending;
+    }
 
-    // make socket non blocking
-    int flags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    // let the listener send the rest when the sockets are writable again
+    if (wake) {
+        wake_listener(handle);
+    }
+    return queued;
+}
 
-    // create a new connection struct
-    Connection *conn = calloc(sizeof(Connection), 1);
-	conn->remoteIP = calloc(45, sizeof(char));
-    conn->fd = fd;
-    conn->id = handle->connectionID++;
-    conn->lastTimeActive = time(NULL);
+bool server_group_join(ServerHandle handle, const char *group, Connection *connection) {
+    pthread_mutex_lock(&handle->groupMutex);
 
-    // fill out the remote address and port
-    if (remoteAddr.ss_family == AF_INET) {
-        struct sockaddr_in *addr = (struct sockaddr_in *)&remoteAddr;
-        inet_ntop(remoteAddr.ss_family, (const void *)&addr->sin_addr, conn->remoteIP, 45);
-        conn->remotePort = addr->sin_port;
+    // closing connections leave their groups, do not let them join again
+    if (__atomic_load_n(&connection->state, __ATOMIC_SEQ_CST) & CONNECTION_CLOSED) {
+        pthread_mutex_unlock(&handle->groupMutex);
+        return false;
+    }
 
-        DebugLog("[ACCEPT] Remote %s:%d\n", conn->remoteIP, conn->remotePort);
-    } else if (remoteAddr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&remoteAddr;
-        inet_ntop(remoteAddr.ss_family, (const void *)&addr->sin6_addr, conn->remoteIP, 45);
-        conn->remotePort = addr->sin6_port;
+    // find or create the group
+    struct _Group *g = find_group(handle, group);
+    if (g == NULL) {
+        g = create_group(handle, group);
+    }
 
-        DebugLog("[ACCEPT] Remote [%s]:%d\n", conn->remoteIP, conn->remotePort);
+    // already a member? a connection is only in a few groups, check its own list
+    if (find_membership(connection, g) >= 0) {
+        pthread_mutex_unlock(&handle->groupMutex);
+        return false;
     }
 
-    // add connection to list
-    pthread_mutex_lock(&handle->connectionMutex);
-    if (handle->allocatedConnections == handle->numConnections) {
-        handle->allocatedConnections *= 2;
-        handle->connections = realloc(handle->connections, handle->allocatedConnections * sizeof(Connection *));
+    if (g->numMembers == g->allocatedMembers) {
+        g->allocatedMembers = (g->allocatedMembers > 0) ? g->allocatedMembers * 2 : 16;
+        g->members = realloc(g->members, g->allocatedMembers * sizeof(struct _Member));
     }
-    handle->connections[handle->numConnections] = conn;
-    handle->numConnections++;
-    pthread_mutex_unlock(&handle->connectionMutex);
+    if (connection->numGroups == connection->allocatedGroups) {
+        connection->allocatedGroups = (connection->allocatedGroups > 0) ? connection->allocatedGroups * 2 : 4;
+        connection->groups = realloc(connection->groups, connection->allocatedGroups * sizeof(struct _Membership));
+    }
+    g->members[g->numMembers].connection = connection;
+    g->members[g->numMembers].membership = connection->numGroups;
+    connection->groups[connection->numGroups].group = g;
+    connection->groups[connection->numGroups].slot = g->numMembers;
+    g->numMembers++;
+    connection->numGroups++;
+
+    pthread_mutex_unlock(&handle->groupMutex);
+    return true;
 }
 
-static void close_idle_connections(ServerHandle handle) {
-    pthread_mutex_lock(&handle->connectionMutex);
+void server_group_leave(ServerHandle handle, const char *group, Connection *connection) {
+    pthread_mutex_lock(&handle->groupMutex);
+    struct _Group *g = find_group(handle, group);
+    int membership = (g) ? find_membership(connection, g) : -1;
+    if (membership >= 0) {
+        group_remove(g, connection->groups[membership].slot);
+    }
+    pthread_mutex_unlock(&handle->groupMutex);
+}
 
-    // remove from open connection list
-    int removedConnections = 0;
-    for(int i = 0; i < handle->numConnections; i++) {
-        Connection *connection = handle->connections[i];
-        if ((connection->sending == false) && (connection->lastTimeActive < time(NULL) - handle->timeout)) {
+int server_broadcast_group(ServerHandle handle, const char *group, SharedBuffer *buffer) {
+    int queued = 0;
+    int count = 0;
+    Connection **members = NULL;
+
+    // copy the member list, sending may close members which makes them leave the group
+    epoch_enter();
+    pthread_mutex_lock(&handle->groupMutex);
+    struct _Group *g = find_group(handle, group);
+    if (g && (g->numMembers > 0)) {
+        count = g->numMembers;
+        members = malloc(count * sizeof(Connection *));
+        for(int i = 0; i < count; i++) {
+            members[i] = g->members[i].connection;
+        }
+    }
+    pthread_mutex_unlock(&handle->groupMutex);
+
+    if (members) {
+        queued = server_broadcast(handle, buffer, members, count);
+        free(members);
+    }
+    epoch_exit();
+    return queued;
+}
+
+bool server_connection_resume(ResumeToken token, bool keepConnection) {
+    ServerHandle handle = token.server;
+    bool resumed = false;
+
+    epoch_enter();
+    Connection *connection = find_connection(handle, token.connectionID);
+    if (connection) {
+        resumed = finish_request(handle, connection, token.request, keepConnection);
+    }
+    epoch_exit();
+
+    return resumed;
+}
+
+// end a pending async request, fails if `request` is not the one pending (any more)
+static bool finish_request(ServerHandle handle, Connection *connection, uint32_t request, bool keepConnection) {
+    // a token only resumes the request it was issued for, and only once
+    if ((request == 0) || !__atomic_compare_exchange_n(&connection->pendingRequest, &request, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return false;
+    }
+    uint32_t state = __atomic_fetch_and(&connection->state, ~CONNECTION_PENDING, __ATOMIC_SEQ_CST);
+    if (!(state & CONNECTION_PENDING)) {
+        return false;
+    }
+
+    if (!keepConnection) {
+        DebugLog("[RESUME] closing connection %d upon request\n", connection->id);
+        close_connection(handle, connection);
+    }
+
+    // if the reader already returned we finish the read, else the reader does
+    if (state & CONNECTION_SUSPENDED) {
+        __atomic_fetch_and(&connection->state, ~CONNECTION_SUSPENDED, __ATOMIC_SEQ_CST);
+        if (end_receive(handle, connection)) {
+            wake_listener(handle);
+        }
+    }
+    return true;
+}
+
+void server_close_connection(Connection *connection) {
+    close_connection(connection->server, connection);
+}
+
+Connection *server_connection_lookup(ServerHandle handle, int id) {
+    Connection *result = NULL;
+
+    epoch_enter();
+    Connection *connection = find_connection(handle, id);
+    if (connection && !(__atomic_load_n(&connection->state, __ATOMIC_ACQUIRE) & CONNECTION_CLOSED)) {
+        result = connection;
+    }
+    epoch_exit();
+
+    return result;
+}
+
+bool server_connection_set_options(Connection *connection, const SocketOptions *options) {
+    return apply_socket_options(connection->fd, options);
+}
+
+void server_send_data(Connection *connection, const char *data, size_t len) {
+    struct _SendQueue *queue = connection->sendQueue;
+    if (connection->server->capture) {
+        capture_write(connection->server->capture, connection->id, CAPTURE_OUT, data, len);
+    }
+    pthread_mutex_lock(&queue->mutex);
+
+    // shared memory channel, copy into the ring
+    if (connection->shm) {
+        bool corrupt = false;
+        __atomic_fetch_or(&connection->state, CONNECTION_SENDING, __ATOMIC_RELAXED);
+        if (!send_closed(connection) && !shm_channel_write_all(connection->shm, data, len, connection->server->timeout * 1000)) {
+            DebugLog("[SEND:%d] Could not send data: %s\n", connection->id, strerror(errno));
+            corrupt = (errno == EPROTO);
+        }
+        __atomic_fetch_and(&connection->state, ~CONNECTION_SENDING, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue->mutex);
+        if (corrupt) {
+            server_close_connection(connection);
+        }
+        return;
+    }
+
+    // try to send right away if nothing is queued, a closed peer must not kill the process
+    size_t bytesWritten = 0;
+    if (queue->count == 0) {
+        __atomic_fetch_or(&connection->state, CONNECTION_SENDING, __ATOMIC_RELAXED);
+        while ((bytesWritten < len) && !send_closed(connection)) {
+            ssize_t result = send(connection->fd, data + bytesWritten, len - bytesWritten, MSG_NOSIGNAL);
+            if (result < 0) {
+                // error occured, check if it was recoverable
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                // socket buffer full, the listener sends the rest
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                    break;
+                }
+
+                // not recoverable
+                DebugLog("[SEND:%d] Could not send data: %s\n", connection->id, strerror(errno));
+                queue->failed = true;
+                break;
+            }
+
+            bytesWritten += result;
+            __atomic_store_n(&connection->lastTimeActive, time(NULL), __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_and(&connection->state, ~CONNECTION_SENDING, __ATOMIC_RELAXED);
+    }
+
+    // queue a copy of what is left behind the data that is already waiting
+    bool pending = false;
+    if ((bytesWritten < len) && !send_closed(connection) && !queue->failed) {
+        if (!send_budget(connection, len - bytesWritten)) {
+            queue->failed = true;
+        } else {
+            SharedBuffer *buffer = server_buffer_create(data + bytesWritten, len - bytesWritten);
+            pending = send_push(connection, buffer);
+            server_buffer_release(buffer);
+        }
+    }
+
+    bool failed = queue->failed;
+    pthread_mutex_unlock(&queue->mutex);
+    if (failed) {
+        server_close_connection(connection);
+    } else if (pending) {
+        wake_listener(connection->server);
+    }
+}
+
+void server_send_file(Connection *connection, const char *filename) {
+    // open filne
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        DebugLog("[SEND:%d] Could not open file: %s\n", connection->id, strerror(errno));
+        return;
+    }
+
+    // fetch file size
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    fstat(fd, &st);
+    size_t fileSize = st.st_size;
+    if (connection->server->capture) {
+        capture_write(connection->server->capture, connection->id, CAPTURE_OUT, NULL, fileSize);
+    }
+
+
+    struct _SendQueue *queue = connection->sendQueue;
+    pthread_mutex_lock(&queue->mutex);
+
+    // no sendfile for shared memory channels, copy through the ring
+    if (connection->shm) {
+        char buffer[READ_BUFFER_SIZE];
+        ssize_t bytesRead;
+        bool corrupt = false;
+        __atomic_fetch_or(&connection->state, CONNECTION_SENDING, __ATOMIC_RELAXED);
+        while (!send_closed(connection) && ((bytesRead = read(fd, buffer, READ_BUFFER_SIZE)) > 0)) {
+            if (!shm_channel_write_all(connection->shm, buffer, bytesRead, connection->server->timeout * 1000)) {
+                DebugLog("[SEND:%d] Could not send file: %s\n", connection->id, strerror(errno));
+                corrupt = (errno == EPROTO);
+                break;
+            }
+        }
+        __atomic_fetch_and(&connection->state, ~CONNECTION_SENDING, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue->mutex);
+        close(fd);
+        if (corrupt) {
+            server_close_connection(connection);
+        }
+        return;
+    }
+
+    // the file goes into the send queue behind the queued data, the listener sends it when
+    // the socket is writable. The queue owns the file from now on
+    bool pending = false;
+    if (send_closed(connection)) {
+        close(fd);
+    } else {
+        pending = send_push_file(connection, fd, fileSize);
+    }
+
+    bool failed = queue->failed;
+    pthread_mutex_unlock(&queue->mutex);
+    if (failed) {
+        server_close_connection(connection);
+    } else if (pending) {
+        wake_listener(connection->server);
+    }
+}
+
+
+/*
+ * MARK: - Accept thread
+ */
+
+void *listener(void *data) {
+	ServerHandle handle = (ServerHandle)data;
+
+    // prepare timeout
+    struct timeval tv;
+    memset(&tv, 0, sizeof(struct timeval));
+
+    DebugLog("[Listener thread] Hello\n");
+
+    // select loop
+	while (42) {
+        // quit signal, join main thread
+        if (handle->quit) {
+            DebugLog("[Listener thread] Bye\n");
+            pthread_exit(NULL);
+        }
+
+        // unlink closed connections
+        reap_connections(handle);
+
+        // new pass, changes made before this point are seen by build_select_mask and were reaped
+        __atomic_add_fetch(&handle->listenerPasses, 1, __ATOMIC_SEQ_CST);
+
+        // free closed connections and old connection tables nobody can see anymore
+        epoch_collect();
+
+        // spin on the connections first when in busy poll mode
+        struct selectMask msk;
+        int result = 0;
+        if (handle->busyPoll > 0) {
+            result = busy_poll(handle, &msk);
+        }
+
+        if (result == 0) {
+            // select on all open connections until someone has something to read
+            msk = build_select_mask(handle);
+
+            // reset timeout as linux rewrites it with the unused time, wake up early for throttled connections
+            tv.tv_sec = handle->timeout;
+            tv.tv_usec = 0;
+            if (msk.wakeup) {
+                uint64_t now = now_ms();
+                uint64_t delay = (msk.wakeup > now) ? msk.wakeup - now : 1;
+                if (delay < (uint64_t)handle->timeout * 1000) {
+                    tv.tv_sec = delay / 1000;
+                    tv.tv_usec = (delay % 1000) * 1000;
+                }
+            }
+
+            result = select(msk.maxFD + 1, &msk.readSet, &msk.writeSet, NULL, &tv);
+        }
+
+        if (result == 0) {
+            // timeout, kick all open connections that are not sending currently
+            close_idle_connections(handle);
+        } else if ((result < 0) && (errno != EINTR) && (errno != EBADF)) {
+            DebugLog("[Listener thread] Error in select: %s\n", strerror(errno));
+            pthread_exit(NULL);
+        }
+
+        // Clear signal pipe
+        if (FD_ISSET(handle->signalPipe[0], &msk.readSet)) {
+            DebugLog("[Listener thread] Woken up by signal pipe\n");
+            char buf[1000];
+            read(handle->signalPipe[0], buf, 1000);
+        }
+
+        // Check if we can accept a connection
+        if (msk.accepting && FD_ISSET(handle->socket, &msk.readSet)) {
+            accept_connection(handle);
+        }
+        if (msk.accepting && (handle->shmSocket >= 0) && FD_ISSET(handle->shmSocket, &msk.readSet)) {
+            accept_shm_connection(handle);
+        }
+
+        // connections from the predecessor
+        if ((handle->handoverChannel >= 0) && FD_ISSET(handle->handoverChannel, &msk.readSet)) {
+            receive_handover(handle);
+        }
+
+        // check all open connections, send queued data and start read threads
+        if (result > 0) {
+            write_data(handle, msk.writeSet);
+            read_data(handle, msk.readSet);
+        }
+    }
+}
+
+static void accept_connection(ServerHandle handle) {
+    // accept all pending clients until the listen queue is empty
+    while (42) {
+        // zero out the remote address struct
+        struct sockaddr_storage remoteAddr;
+        memset(&remoteAddr, 0, sizeof(struct sockaddr_storage));
+        socklen_t len = sizeof(struct sockaddr_storage);
+
+#if defined(__APPLE__) && defined(__MACH__)
+        int fd = accept(handle->socket, (struct sockaddr *)&remoteAddr, &len);
+        if (fd >= 0) {
+            // make socket non blocking
+            int flags = fcntl(fd, F_GETFL, 0);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#else
+        int fd = accept4(handle->socket, (struct sockaddr *)&remoteAddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#endif
+
+        // if some error happened determine if it is recoverable
+        if (fd < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                DebugLog("[ACCEPT] Error while accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        if (!admit_connection(handle, fd)) {
+            close(fd);
+            continue;
+        }
+        // socket options and busy polling are inherited from the listener
+        disable_sigpipe(fd);
+
+        // create a new connection struct
+        Connection *conn = create_connection(handle, fd);
+
+        // fill out the remote address and port
+        if (remoteAddr.ss_family == AF_INET) {
+            struct sockaddr_in *addr = (struct sockaddr_in *)&remoteAddr;
+            inet_ntop(remoteAddr.ss_family, (const void *)&addr->sin_addr, conn->remoteIP, 46);
+            conn->remotePort = ntohs(addr->sin_port);
+
+            DebugLog("[ACCEPT] Remote %s:%d\n", conn->remoteIP, conn->remotePort);
+        } else if (remoteAddr.ss_family == AF_INET6) {
+            struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&remoteAddr;
+            inet_ntop(remoteAddr.ss_family, (const void *)&addr->sin6_addr, conn->remoteIP, 46);
+            conn->remotePort = ntohs(addr->sin6_port);
+
+            DebugLog("[ACCEPT] Remote [%s]:%d\n", conn->remoteIP, conn->remotePort);
+        }
+
+        add_connection(handle, conn);
+    }
+}
+
+// check descriptor and connection limits for a new client, the caller closes rejected ones
+static bool admit_connection(ServerHandle handle, int fd) {
+    // select can not handle descriptors above FD_SETSIZE
+    if (fd >= FD_SETSIZE) {
+        DebugLog("[ACCEPT] Descriptor %d exceeds FD_SETSIZE, rejecting connection\n", fd);
+        return false;
+    }
+
+    // make room by closing the oldest idle connection, reject the new one if that did not help
+    bool full = (handle->maxConnections > 0) && (connection_count(handle) >= handle->maxConnections);
+    if ((handle->softConnections > 0) && (connection_count(handle) >= handle->softConnections)) {
+        full = !shed_idle_connection(handle);
+    }
+    if (full) {
+        DebugLog("[ACCEPT] Connection limit reached, rejecting connection\n");
+        __atomic_add_fetch(&handle->rejectedConnections, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_add_fetch(&handle->accepted, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void accept_shm_connection(ServerHandle handle) {
+    // accept all pending clients until the listen queue is empty
+    while (42) {
+        int fd = accept(handle->shmSocket, NULL, NULL);
+        if (fd < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                DebugLog("[SHM] Error while accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        // the socket is only needed to pass the mapping and doorbells
+        shm_channel channel = shm_server_accept(fd, handle->shmRingSize);
+        close(fd);
+        if (channel == NULL) {
+            continue;
+        }
+
+        // same rules as for network clients
+        if (!admit_connection(handle, shm_channel_fd(channel))) {
+            shm_channel_close(channel);
+            continue;
+        }
+
+        // the doorbell takes the place of the socket in the select loop
+        Connection *conn = create_connection(handle, shm_channel_fd(channel));
+        conn->shm = channel;
+        strcpy(conn->remoteIP, "shm");
+
+        DebugLog("[SHM] Channel %d\n", conn->id);
+        add_connection(handle, conn);
+    }
+}
+
+static ssize_t connection_read(Connection *connection, char *buffer, size_t len) {
+    if (connection->shm) {
+        return shm_channel_read(connection->shm, buffer, len);
+    }
+    return read(connection->fd, buffer, len);
+}
+
+static Connection *create_connection(ServerHandle handle, int fd) {
+    Connection *conn = calloc(sizeof(Connection), 1);
+    conn->remoteIP = calloc(46, sizeof(char));
+    conn->fd = fd;
+    conn->id = handle->connectionID++;
+    conn->priority = handle->acceptPriority;
+    conn->lastTimeActive = time(NULL);
+    conn->server = handle;
+
+    conn->sendQueue = calloc(sizeof(struct _SendQueue), 1);
+    pthread_mutex_init(&conn->sendQueue->mutex, NULL);
+
+    return conn;
+}
+
+static void add_connection(ServerHandle handle, Connection *connection) {
+    if (handle->capture) {
+        capture_write(handle->capture, connection->id, CAPTURE_OPEN, connection->remoteIP, strlen(connection->remoteIP));
+    }
+
+    pthread_mutex_lock(&handle->connectionMutex);
+    struct connectionTable *table = handle->connections;
+
+    // keep at least half of the slots empty so probe sequences stay short
+    if ((handle->usedSlots + 1) * 2 > table->capacity) {
+        int capacity = table->capacity;
+        if ((handle->numConnections + 1) * 4 > capacity) {
+            capacity *= 2;
+        }
+
+        // grow (or just drop the tombstones), readers of the old table are still safe
+        struct connectionTable *grown = connection_table_create(capacity);
+        for(int i = 0; i < table->capacity; i++) {
+            Connection *item = connection_at(table, i);
+            if (item) {
+                int slot = (unsigned)item->id & (grown->capacity - 1);
+                while (grown->slots[slot]) {
+                    slot = (slot + 1) & (grown->capacity - 1);
+                }
+                grown->slots[slot] = item;
+            }
+        }
+        handle->usedSlots = handle->numConnections;
+        __atomic_store_n(&handle->connections, grown, __ATOMIC_RELEASE);
+        epoch_retire(table, free);
+        table = grown;
+    }
+
+    // first free slot of the probe sequence, tombstones may be reused
+    int slot = (unsigned)connection->id & (table->capacity - 1);
+    while (42) {
+        Connection *item = table->slots[slot];
+        if ((item == NULL) || (item == &connectionTombstone)) {
+            if (item == NULL) {
+                handle->usedSlots++;
+            }
+            break;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    __atomic_store_n(&table->slots[slot], connection, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&handle->numConnections, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&handle->connectionMutex);
+}
+
+static bool remove_connection(ServerHandle handle, Connection *connection) {
+    bool found = false;
+
+    pthread_mutex_lock(&handle->connectionMutex);
+    struct connectionTable *table = handle->connections;
+    int slot = (unsigned)connection->id & (table->capacity - 1);
+    while (42) {
+        Connection *item = table->slots[slot];
+        if (item == NULL) {
+            break;
+        }
+        if (item == connection) {
+            // probing for other connections has to continue past this slot
+            __atomic_store_n(&table->slots[slot], &connectionTombstone, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&handle->numConnections, 1, __ATOMIC_RELAXED);
+            found = true;
+            break;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    pthread_mutex_unlock(&handle->connectionMutex);
+
+    return found;
+}
+
+static struct connectionTable *connection_table_create(int capacity) {
+    struct connectionTable *table = calloc(sizeof(struct connectionTable) + capacity * sizeof(Connection *), 1);
+    table->capacity = capacity;
+    return table;
+}
+
+// connection in a table slot, NULL for empty and removed slots. Call inside an epoch
+static Connection *connection_at(struct connectionTable *table, int index) {
+    Connection *connection = __atomic_load_n(&table->slots[index], __ATOMIC_ACQUIRE);
+    if (connection == &connectionTombstone) {
+        return NULL;
+    }
+    return connection;
+}
+
+// find a connection by ID, may return closed connections. Call inside an epoch
+static Connection *find_connection(ServerHandle handle, int id) {
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    int slot = (unsigned)id & (table->capacity - 1);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+        if (connection == NULL) {
+            break;
+        }
+        if ((connection != &connectionTombstone) && (connection->id == id)) {
+            return connection;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+static void close_idle_connections(ServerHandle handle) {
+    epoch_enter();
+
+    time_t threshold = time(NULL) - handle->timeout;
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection == NULL) {
+            continue;
+        }
+        uint32_t state = __atomic_load_n(&connection->state, __ATOMIC_ACQUIRE);
+        bool pendingOutput = __atomic_load_n(&connection->sendQueue->queuedBytes, __ATOMIC_RELAXED) > 0;
+        time_t lastTimeActive = __atomic_load_n(&connection->lastTimeActive, __ATOMIC_RELAXED);
+        if (((state & (CONNECTION_SENDING | CONNECTION_RECEIVING | CONNECTION_CLOSED)) == 0) && !pendingOutput && (lastTimeActive < threshold)) {
             DebugLog("[IDLE] closing idle connection %d\n", connection->id);
+            close_connection(handle, connection);
+        }
+    }
+
+    epoch_exit();
+}
+
+// close the idle connection that was inactive for the longest time, returns false if there is none
+static bool shed_idle_connection(ServerHandle handle) {
+    epoch_enter();
+
+    // only connections that were quiet for a while count as idle
+    time_t threshold = time(NULL) - ((handle->timeout > SHED_IDLE_DIVISOR) ? handle->timeout / SHED_IDLE_DIVISOR : 1);
+    Connection *oldest = NULL;
+    time_t oldestTimeActive = 0;
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection == NULL) {
+            continue;
+        }
+        uint32_t state = __atomic_load_n(&connection->state, __ATOMIC_ACQUIRE);
+        bool pendingOutput = __atomic_load_n(&connection->sendQueue->queuedBytes, __ATOMIC_RELAXED) > 0;
+        time_t lastTimeActive = __atomic_load_n(&connection->lastTimeActive, __ATOMIC_RELAXED);
+        if ((state & (CONNECTION_SENDING | CONNECTION_RECEIVING | CONNECTION_CLOSED)) || pendingOutput || (lastTimeActive > threshold)) {
+            continue;
+        }
+        if ((oldest == NULL) || (lastTimeActive < oldestTimeActive)) {
+            oldest = connection;
+            oldestTimeActive = lastTimeActive;
+        }
+    }
+    if (oldest) {
+        DebugLog("[SHED] closing idle connection %d\n", oldest->id);
+        __atomic_add_fetch(&handle->shedConnections, 1, __ATOMIC_RELAXED);
+        // we are on the listener, free the slot right away so the new connection fits
+        close_connection(handle, oldest);
+        destroy_connection(handle, oldest);
+    }
+
+    epoch_exit();
+    return (oldest != NULL);
+}
+
+static int connection_count(ServerHandle handle) {
+    return __atomic_load_n(&handle->numConnections, __ATOMIC_RELAXED);
+}
+
+// mark a connection as closed, the listener unlinks and frees it. Takes no lock, safe from any thread
+static void close_connection(ServerHandle handle, Connection *connection) {
+    // only the first close counts
+    uint32_t state = __atomic_fetch_or(&connection->state, CONNECTION_CLOSED, __ATOMIC_SEQ_CST);
+    if (state & CONNECTION_CLOSED) {
+        return;
+    }
+
+    // a reader is still using the connection, end_receive will hand it to the listener
+    if (state & CONNECTION_RECEIVING) {
+        DebugLog("[CLOSE] connection %d still receiving, deferring close\n", connection->id);
+        return;
+    }
+
+    __atomic_add_fetch(&handle->pendingCloses, 1, __ATOMIC_SEQ_CST);
+    wake_listener(handle);
+}
+
+// destroy all closed connections without a reader, only called by the listener
+static void reap_connections(ServerHandle handle) {
+    if (__atomic_exchange_n(&handle->pendingCloses, 0, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+
+    epoch_enter();
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection == NULL) {
+            continue;
+        }
+        uint32_t state = __atomic_load_n(&connection->state, __ATOMIC_ACQUIRE);
+        if ((state & (CONNECTION_CLOSED | CONNECTION_RECEIVING)) == CONNECTION_CLOSED) {
+            destroy_connection(handle, connection);
+        }
+    }
+    epoch_exit();
+}
+
+// unlink a closed connection and retire it, only the listener (or server_stop after it) calls this
+static void destroy_connection(ServerHandle handle, Connection *connection) {
+    if (!remove_connection(handle, connection)) {
+        return;
+    }
+    DebugLog("[CLOSE] closing connection %d\n", connection->id);
+    if (handle->capture) {
+        capture_write(handle->capture, connection->id, CAPTURE_CLOSE, NULL, 0);
+    }
+    release_connection(handle, connection);
+    if (connection->shm) {
+        // closes the doorbell we selected on too
+        shm_channel_close(connection->shm);
+        connection->shm = NULL;
+    } else {
+        close(connection->fd);
+    }
+
+    // threads that loaded the connection from the table may still look at it
+    epoch_retire(connection, free_connection);
+}
+
+static void free_connection(void *data) {
+    Connection *connection = (Connection *)data;
+
+    free(connection->remoteIP);
+    free(connection->groups);
+    pthread_mutex_destroy(&connection->sendQueue->mutex);
+    free(connection->sendQueue->items);
+    free(connection->sendQueue);
+    free(connection);
+}
+
+// mark a connection as receiving, fails if it is closed or already has a reader
+static bool begin_receive(Connection *connection) {
+    uint32_t state = __atomic_load_n(&connection->state, __ATOMIC_ACQUIRE);
+    do {
+        if (state & (CONNECTION_CLOSED | CONNECTION_RECEIVING)) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&connection->state, &state, state | CONNECTION_RECEIVING, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE));
+
+    return true;
+}
+
+// clear the receiving flag, hands a deferred close to the listener. Returns false if the connection is closed
+static bool end_receive(ServerHandle handle, Connection *connection) {
+    uint32_t state = __atomic_fetch_and(&connection->state, ~CONNECTION_RECEIVING, __ATOMIC_SEQ_CST);
+    if (state & CONNECTION_CLOSED) {
+        __atomic_add_fetch(&handle->pendingCloses, 1, __ATOMIC_SEQ_CST);
+        wake_listener(handle);
+        return false;
+    }
+    return true;
+}
+
+// run a batch on the listener in busy poll mode, else queue it
+static void dispatch_batch(ServerHandle handle, struct batchTaskData *data, queue_priority priority) {
+    if (data->inlined) {
+        batch_task(data);
+        free(data);
+    } else {
+        queue_add_task_ex(handle->queue, batch_task, clean_task, data, priority, handle->readDeadline, batch_expired);
+    }
+}
+
+static void read_data(ServerHandle handle, fd_set readable) {
+    // no new reads while draining
+    if (__atomic_load_n(&handle->draining, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    epoch_enter();
+
+    // collect all readable connections
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    if (handle->allocatedReadyConnections < table->capacity) {
+        handle->allocatedReadyConnections = table->capacity;
+        handle->readyConnections = realloc(handle->readyConnections, handle->allocatedReadyConnections * sizeof(Connection *));
+    }
+    // number of reads the queue may take
+    int allowed = table->capacity;
+    if ((handle->maxQueuedTasks > 0) && (handle->busyPoll == 0)) {
+        int batchSize = (handle->onReceiveBatch) ? handle->batchSize : 1;
+        int room = handle->maxQueuedTasks - queue_taskcount(handle->queue);
+        allowed = (room > 0) ? room * batchSize : 0;
+    }
+
+    int numReady = 0;
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection && FD_ISSET(connection->fd, &readable) && begin_receive(connection)) {
+            // drain started in the meantime, back off
+            if (__atomic_load_n(&handle->draining, __ATOMIC_SEQ_CST)) {
+                end_receive(handle, connection);
+                continue;
+            }
+
+            // overloaded, leave the data in the socket buffer and try again later
+            if (numReady >= allowed) {
+                __atomic_add_fetch(&handle->deferredReads, 1, __ATOMIC_RELAXED);
+                connection->throttledUntil = now_ms() + OVERLOAD_BACKOFF_MS;
+                end_receive(handle, connection);
+                continue;
+            }
+            __atomic_store_n(&connection->lastTimeActive, time(NULL), __ATOMIC_RELAXED);
+            handle->readyConnections[numReady++] = connection;
+        }
+    }
+
+    // run the reads, the connections can not go away while they are marked as receiving
+    if (handle->onReceiveBatch) {
+        // one task per batch instead of one per connection, batches do not mix priority classes
+        struct batchTaskData *batches[QUEUE_PRIORITY_COUNT] = { NULL };
+        for(int i = 0; i < numReady; i++) {
+            Connection *connection = handle->readyConnections[i];
+            queue_priority priority = connection->priority;
+            if ((priority < 0) || (priority >= QUEUE_PRIORITY_COUNT)) {
+                priority = QUEUE_PRIORITY_NORMAL;
+            }
+
+            struct batchTaskData *data = batches[priority];
+            if (data == NULL) {
+                data = malloc(sizeof(struct batchTaskData) + handle->batchSize * sizeof(Connection *));
+                data->handle = handle;
+                data->inlined = (handle->busyPoll > 0);
+                data->count = 0;
+                batches[priority] = data;
+            }
+            data->connections[data->count++] = connection;
+            if (data->count == handle->batchSize) {
+                dispatch_batch(handle, data, priority);
+                batches[priority] = NULL;
+            }
+        }
+        for(int priority = 0; priority < QUEUE_PRIORITY_COUNT; priority++) {
+            if (batches[priority]) {
+                dispatch_batch(handle, batches[priority], priority);
+            }
+        }
+        numReady = 0;
+    }
+    for(int i = 0; i < numReady; i++) {
+        Connection *connection = handle->readyConnections[i];
+        if (handle->busyPoll > 0) {
+            // busy poll mode, read on the listener thread
+            struct readTaskData data = { handle, connection, true };
+            read_task(&data);
+        } else {
+            struct readTaskData *data = malloc(sizeof(struct readTaskData));
+            data->handle = handle;
+            data->connection = connection;
+            data->inlined = false;
+            queue_add_task_ex(handle->queue, read_task, clean_task, data, connection->priority, handle->readDeadline, read_expired);
+        }
+    }
+
+    epoch_exit();
+}
+
+// poll without timeout until something happens or the spin budget is used up, returns the select result
+static int busy_poll(ServerHandle handle, struct selectMask *msk) {
+    uint64_t spinUntil = now_us() + handle->busyPoll;
+    struct timeval tv;
+
+    do {
+        *msk = build_select_mask(handle);
+        memset(&tv, 0, sizeof(struct timeval));
+        int result = select(msk->maxFD + 1, &msk->readSet, &msk->writeSet, NULL, &tv);
+        if (result != 0) {
+            return result;
+        }
+    } while (!handle->quit && (now_us() < spinUntil));
+
+    return 0;
+}
+
+static struct selectMask build_select_mask(ServerHandle handle) {
+    struct selectMask msk;
+    FD_ZERO(&msk.readSet);
+    FD_ZERO(&msk.writeSet);
+    msk.wakeup = 0;
+    uint64_t now = now_ms();
+
+    // add signal pipe to be able to wake the select call
+    msk.maxFD = handle->signalPipe[0];
+    FD_SET(handle->signalPipe[0], &msk.readSet);
+
+    epoch_enter();
+
+    // add socket itselt for selecting on 'accept' calls
+    msk.accepting = __atomic_load_n(&handle->accepting, __ATOMIC_SEQ_CST) && (handle->socket >= 0);
+    if (msk.accepting) {
+        if (handle->socket > msk.maxFD) {
+            msk.maxFD = handle->socket;
+        }
+        FD_SET(handle->socket, &msk.readSet);
+
+        // shared memory channel negotiation
+        if (handle->shmSocket >= 0) {
+            if (handle->shmSocket > msk.maxFD) {
+                msk.maxFD = handle->shmSocket;
+            }
+            FD_SET(handle->shmSocket, &msk.readSet);
+        }
+    }
+
+    // predecessor still sends connections
+    if (handle->handoverChannel >= 0) {
+        if (handle->handoverChannel > msk.maxFD) {
+            msk.maxFD = handle->handoverChannel;
+        }
+        FD_SET(handle->handoverChannel, &msk.readSet);
+    }
+
+    // add all open connections, only flush queued data while draining
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    bool draining = __atomic_load_n(&handle->draining, __ATOMIC_SEQ_CST);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection == NULL) {
+            continue;
+        }
+        uint32_t state = __atomic_load_n(&connection->state, __ATOMIC_ACQUIRE);
+        if (state & CONNECTION_CLOSED) {
+            continue;
+        }
+
+        // wait for writability if there is queued data
+        if (__atomic_load_n(&connection->sendQueue->queuedBytes, __ATOMIC_RELAXED) > 0) {
+            if (connection->fd > msk.maxFD) {
+                msk.maxFD = connection->fd;
+            }
+            FD_SET(connection->fd, &msk.writeSet);
+        }
+
+        if (draining || (state & CONNECTION_RECEIVING)) {
+            continue;
+        }
+        if (connection->throttledUntil > now) {
+            // rate limited, remember when to try again
+            if ((msk.wakeup == 0) || (connection->throttledUntil < msk.wakeup)) {
+                msk.wakeup = connection->throttledUntil;
+            }
+            continue;
+        }
+        if (connection->fd > msk.maxFD) {
+            msk.maxFD = connection->fd;
+        }
+        FD_SET(connection->fd, &msk.readSet);
+    }
+    epoch_exit();
+
+    // return the set
+    return msk;
+}
+
+// copy the settings of a server configuration to the handle, the version has to be checked already
+static void apply_config(ServerHandle handle, const ServerConfig *config) {
+    server_set_listen_options(handle, config->backlog, config->deferAccept, config->fastOpen);
+    handle->acceptPriority = config->acceptPriority;
+    handle->socketOptions = config->socketOptions;
+    handle->hasSocketOptions = has_socket_options(&handle->socketOptions);
+    if (config->version >= 2) {
+        handle->busyPoll = config->busyPoll;
+        handle->busyPollSocket = config->busyPollSocket;
+    }
+}
+
+static ServerHandle create_handle(int timeout) {
+    ServerHandle handle = calloc(sizeof(struct _ServerHandle), 1);
+
+    // initialize handle
+    handle->timeout = timeout;
+    handle->socket = -1;
+    handle->shmSocket = -1;
+    handle->handoverChannel = -1;
+    handle->accepting = true;
+    handle->acceptPriority = QUEUE_PRIORITY_NORMAL;
+    handle->backlog = SOMAXCONN;
+    server_socket_options_init(&handle->socketOptions);
+    handle->readQuantum = READ_BUFFER_SIZE;
+    handle->readMessages = 1;
+    handle->connections = connection_table_create(CONNECTION_TABLE_MIN);
+    if (pipe(handle->signalPipe)) {
+        free(handle->connections);
+        free(handle);
+        DebugLog("pipe call failed: %s\n", strerror(errno));
+        return NULL;
+    }
+    int flags = fcntl(handle->signalPipe[0], F_GETFL, 0);
+    fcntl(handle->signalPipe[0], F_SETFL, flags | O_NONBLOCK);
+
+    pthread_mutex_init(&handle->rateLimitMutex, NULL);
+    pthread_mutex_init(&handle->groupMutex, NULL);
+    pthread_mutex_init(&handle->connectionMutex, NULL);
+
+    return handle;
+}
+
+// free a handle that never got started, undoes create_handle
+static void destroy_handle(ServerHandle handle) {
+    if (handle->socket >= 0) {
+        close(handle->socket);
+    }
+    close(handle->signalPipe[0]);
+    close(handle->signalPipe[1]);
+    free(handle->connections);
+    pthread_mutex_destroy(&handle->groupMutex);
+    pthread_mutex_destroy(&handle->rateLimitMutex);
+    pthread_mutex_destroy(&handle->connectionMutex);
+    free(handle);
+}
+
+static bool has_socket_options(const SocketOptions *options) {
+    return (options->noDelay >= 0) || (options->receiveBuffer >= 0) || (options->sendBuffer >= 0) ||
+           (options->keepAlive >= 0) || (options->keepAliveIdle >= 0) || (options->keepAliveInterval >= 0) ||
+           (options->keepAliveCount >= 0) || (options->userTimeout >= 0) || (options->linger >= 0) ||
+           (options->notSentLowat >= 0);
+}
+
+// set all options that are not -1, returns false if one of them failed
+static bool apply_socket_options(int fd, const SocketOptions *options) {
+    bool success = true;
+
+    if (options->noDelay >= 0) {
+        success &= (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &options->noDelay, sizeof(int)) == 0);
+    }
+    if (options->receiveBuffer >= 0) {
+        success &= (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options->receiveBuffer, sizeof(int)) == 0);
+    }
+    if (options->sendBuffer >= 0) {
+        success &= (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options->sendBuffer, sizeof(int)) == 0);
+    }
+    if (options->keepAlive >= 0) {
+        success &= (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &options->keepAlive, sizeof(int)) == 0);
+    }
+    if (options->keepAliveIdle >= 0) {
+#if defined(TCP_KEEPIDLE)
+        success &= (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &options->keepAliveIdle, sizeof(int)) == 0);
+#elif defined(TCP_KEEPALIVE)
+        success &= (setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &options->keepAliveIdle, sizeof(int)) == 0);
+#endif
+    }
+#if defined(TCP_KEEPINTVL)
+    if (options->keepAliveInterval >= 0) {
+        success &= (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &options->keepAliveInterval, sizeof(int)) == 0);
+    }
+#endif
+#if defined(TCP_KEEPCNT)
+    if (options->keepAliveCount >= 0) {
+        success &= (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &options->keepAliveCount, sizeof(int)) == 0);
+    }
+#endif
+#if defined(TCP_USER_TIMEOUT)
+    if (options->userTimeout >= 0) {
+        success &= (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &options->userTimeout, sizeof(int)) == 0);
+    }
+#endif
+    if (options->linger >= 0) {
+        struct linger linger;
+        linger.l_onoff = 1;
+        linger.l_linger = options->linger;
+        success &= (setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(struct linger)) == 0);
+    }
+#if defined(TCP_NOTSENT_LOWAT)
+    if (options->notSentLowat >= 0) {
+        success &= (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &options->notSentLowat, sizeof(int)) == 0);
+    }
+#endif
+
+    if (!success) {
+        DebugLog("Could not set all socket options on %d: %s\n", fd, strerror(errno));
+    }
+    return success;
+}
+
+static uint64_t now_ms(void) {
+    return now_us() / 1000;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void enable_busy_poll(int fd, int usec) {
+#if defined(SO_BUSY_POLL)
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(int))) {
+        DebugLog("Could not set SO_BUSY_POLL: %s\n", strerror(errno));
+    }
+#endif
+#if defined(SO_PREFER_BUSY_POLL)
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &yes, sizeof(int))) {
+        DebugLog("Could not set SO_PREFER_BUSY_POLL: %s\n", strerror(errno));
+    }
+#endif
+}
+
+// writes to a closed peer return EPIPE instead of raising SIGPIPE, on platforms without MSG_NOSIGNAL
+static void disable_sigpipe(int fd) {
+#if defined(SO_NOSIGPIPE)
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(int))) {
+        DebugLog("Could not set SO_NOSIGPIPE: %s\n", strerror(errno));
+    }
+#endif
+}
+
+static void wake_listener(ServerHandle handle) {
+    write(handle->signalPipe[1], "x", 1);
+}
+
+// wait for running reads, async requests that are not resumed within `timeout` seconds are expired
+static void wait_for_readers(ServerHandle handle, int timeout) {
+    uint64_t deadline = now_ms() + (uint64_t)timeout * 1000;
+    bool expired = false;
+
+    while (42) {
+        bool busy = false;
+        epoch_enter();
+        struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+        for(int i = 0; i < table->capacity; i++) {
+            Connection *connection = connection_at(table, i);
+            if (connection && (__atomic_load_n(&connection->state, __ATOMIC_ACQUIRE) & CONNECTION_RECEIVING)) {
+                busy = true;
+                break;
+            }
+        }
+        epoch_exit();
+
+        if (!busy) {
+            return;
+        }
+        if (now_ms() >= deadline) {
+            if (expired) {
+                // a callback is still running, nothing we can do about it
+                DebugLog("[DRAIN] Reads still running after %d seconds, giving up\n", 2 * timeout);
+                return;
+            }
+            DebugLog("[DRAIN] Reads still running after %d seconds, expiring pending requests\n", timeout);
+            expire_requests(handle);
+            expired = true;
+            deadline = now_ms() + (uint64_t)timeout * 1000;
+        }
+        usleep(1000);
+    }
+}
+
+// cancel all pending async requests and close their connections, their tokens can not resume anymore
+static void expire_requests(ServerHandle handle) {
+    epoch_enter();
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection == NULL) {
+            continue;
+        }
+        uint32_t request = __atomic_load_n(&connection->pendingRequest, __ATOMIC_SEQ_CST);
+        if (finish_request(handle, connection, request, false)) {
+            DebugLog("[DRAIN] Expired request %u on connection %d\n", request, connection->id);
+        }
+    }
+    epoch_exit();
+}
+
+// wait until all send queues are empty and no send is running, gives up after timeout seconds
+static void wait_for_senders(ServerHandle handle, int timeout) {
+    uint64_t deadline = now_ms() + (uint64_t)timeout * 1000;
+
+    // the listener flushes when the sockets become writable
+    wake_listener(handle);
+    while (42) {
+        bool busy = false;
+        epoch_enter();
+        struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+        for(int i = 0; i < table->capacity; i++) {
+            Connection *connection = connection_at(table, i);
+            if (connection == NULL) {
+                continue;
+            }
+            uint32_t state = __atomic_load_n(&connection->state, __ATOMIC_ACQUIRE);
+            if (state & CONNECTION_CLOSED) {
+                continue;
+            }
+            if ((state & CONNECTION_SENDING) || (__atomic_load_n(&connection->sendQueue->queuedBytes, __ATOMIC_RELAXED) > 0)) {
+                busy = true;
+                break;
+            }
+        }
+        epoch_exit();
+
+        if (!busy) {
+            return;
+        }
+        if (now_ms() >= deadline) {
+            DebugLog("[DRAIN] Send queues not empty after %d seconds, dropping queued data\n", timeout);
+            return;
+        }
+        usleep(1000);
+    }
+}
+
+// remove the listening socket from the select set and wait until the listener stopped accepting
+static void stop_accepting(ServerHandle handle) {
+    __atomic_store_n(&handle->accepting, false, __ATOMIC_SEQ_CST);
+    if (handle->queue == NULL) {
+        // not started, nobody is accepting
+        return;
+    }
+
+    // the pass that is running may still accept, the next one builds its select set without the socket
+    wait_for_listener(handle);
+}
+
+// wait until the listener started a new pass after all changes made before this call
+static void wait_for_listener(ServerHandle handle) {
+    uint64_t pass = __atomic_load_n(&handle->listenerPasses, __ATOMIC_SEQ_CST);
+    wake_listener(handle);
+    while (!handle->quit && (__atomic_load_n(&handle->listenerPasses, __ATOMIC_SEQ_CST) == pass)) {
+        usleep(100);
+    }
+}
+
+/*
+ * MARK: - Send queues
+ */
+
+// nothing may be queued once close was called, checked with the queue mutex held
+static bool send_closed(Connection *connection) {
+    return connection->sendQueue->closed || (__atomic_load_n(&connection->state, __ATOMIC_ACQUIRE) & CONNECTION_CLOSED);
+}
+
+// queue a buffer on a connection and try to send it right away, `pending` is set if data is left for the listener
+static bool send_enqueue(Connection *connection, SharedBuffer *buffer, bool *pending) {
+    struct _SendQueue *queue = connection->sendQueue;
+    pthread_mutex_lock(&queue->mutex);
+
+    if (send_closed(connection)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
 
-            // close this connection
-            close(connection->fd);
+    // slow receiver, only queue more if the budget allows it
+    if (!connection->shm && !send_budget(connection, buffer->length)) {
+        pthread_mutex_unlock(&queue->mutex);
+        server_close_connection(connection);
+        return false;
+    }
+    if (connection->server->capture) {
+        capture_write(connection->server->capture, connection->id, CAPTURE_OUT, buffer->data, buffer->length);
+    }
+
+    // shared memory channel, copy into the ring
+    if (connection->shm) {
+        bool success = shm_channel_write_all(connection->shm, buffer->data, buffer->length, connection->server->timeout * 1000);
+        bool corrupt = !success && (errno == EPROTO);
+        pthread_mutex_unlock(&queue->mutex);
+        *pending = false;
+        if (corrupt) {
+            server_close_connection(connection);
+        }
+        return success;
+    }
+    *pending = send_push(connection, buffer);
+
+    bool failed = queue->failed;
+    pthread_mutex_unlock(&queue->mutex);
+    if (failed) {
+        server_close_connection(connection);
+        return false;
+    }
+    return true;
+}
+
+// append a buffer to the send queue and try to send, returns true if data is left, call with send queue locked
+static bool send_push(Connection *connection, SharedBuffer *buffer) {
+    struct _SendQueue *queue = connection->sendQueue;
+
+    struct sendItem *item = send_append(connection);
+    item->buffer = server_buffer_retain(buffer);
+    item->file = -1;
+    item->offset = 0;
+    item->length = buffer->length;
+    __atomic_add_fetch(&queue->queuedBytes, buffer->length, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&connection->server->bufferedBytes, buffer->length, __ATOMIC_RELAXED);
+
+    // nothing was queued before, try to send immediately
+    if (queue->count == 1) {
+        send_flush(connection);
+    }
+    return (queue->count > 0);
+}
+
+// append a file to the send queue, it is closed when sent. Does not count against the buffer budget
+static bool send_push_file(Connection *connection, int file, size_t length) {
+    struct _SendQueue *queue = connection->sendQueue;
+
+    struct sendItem *item = send_append(connection);
+    item->buffer = NULL;
+    item->file = file;
+    item->offset = 0;
+    item->length = length;
+    __atomic_add_fetch(&queue->queuedBytes, length, __ATOMIC_RELAXED);
+
+    if (queue->count == 1) {
+        send_flush(connection);
+    }
+    return (queue->count > 0);
+}
 
-		   	// free remote ip pointer
-			free(connection->remoteIP);
+// make room for one more item at the end of the queue, call with send queue locked
+static struct sendItem *send_append(Connection *connection) {
+    struct _SendQueue *queue = connection->sendQueue;
+
+    // grow the ring buffer, unwrapping it
+    if (queue->count == queue->allocated) {
+        int allocated = (queue->allocated > 0) ? queue->allocated * 2 : 8;
+        struct sendItem *items = malloc(allocated * sizeof(struct sendItem));
+        for(int i = 0; i < queue->count; i++) {
+            items[i] = queue->items[(queue->first + i) % queue->allocated];
+        }
+        free(queue->items);
+        queue->items = items;
+        queue->allocated = allocated;
+        queue->first = 0;
+    }
+
+    queue->count++;
+    return &queue->items[(queue->first + queue->count - 1) % queue->allocated];
+}
+
+// remove the first item of the queue, call with send queue locked
+static void send_pop(struct _SendQueue *queue) {
+    struct sendItem *item = &queue->items[queue->first];
+    if (item->buffer) {
+        server_buffer_release(item->buffer);
+    } else {
+        close(item->file);
+    }
+    queue->first = (queue->first + 1) % queue->allocated;
+    queue->count--;
+}
+
+// send as much queued data as the socket takes without blocking, call with send queue locked
+static void send_flush(Connection *connection) {
+    struct _SendQueue *queue = connection->sendQueue;
+
+    while (queue->count > 0) {
+        struct sendItem *first = &queue->items[queue->first];
+
+        // files go out on their own
+        if (first->file >= 0) {
+            off_t offset = first->offset;
+            ssize_t result = send_file_chunk(connection->fd, first->file, &offset, first->length - first->offset);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                    DebugLog("[SEND:%d] Could not send file: %s\n", connection->id, strerror(errno));
+                    send_queue_clear(connection);
+                    queue->failed = true;
+                }
+                return;
+            }
+            __atomic_store_n(&connection->lastTimeActive, time(NULL), __ATOMIC_RELAXED);
+
+            // the file may have been truncated, count the missing part as sent
+            size_t sent = (result > 0) ? (size_t)result : first->length - first->offset;
+            first->offset += sent;
+            __atomic_sub_fetch(&queue->queuedBytes, sent, __ATOMIC_RELAXED);
+            if (first->offset >= first->length) {
+                send_pop(queue);
+            }
+            continue;
+        }
+
+        // gather the pending buffers up to the next file
+        struct iovec iov[SEND_IOV_MAX];
+        int numIov = 0;
+        while ((numIov < queue->count) && (numIov < SEND_IOV_MAX)) {
+            struct sendItem *item = &queue->items[(queue->first + numIov) % queue->allocated];
+            if (item->buffer == NULL) {
+                break;
+            }
+            iov[numIov].iov_base = item->buffer->data + item->offset;
+            iov[numIov].iov_len = item->length - item->offset;
+            numIov++;
+        }
 
-            // remove from list
-            if (i == handle->numConnections - 1) {
-                // last one, just decrement connection count
-                removedConnections++;
+        // like writev, but a closed peer must not raise SIGPIPE
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = numIov;
+        ssize_t result = sendmsg(connection->fd, &msg, MSG_NOSIGNAL);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                // not recoverable (EPIPE, ECONNRESET), the caller closes the connection
+                DebugLog("[SEND:%d] Could not send data: %s\n", connection->id, strerror(errno));
+                send_queue_clear(connection);
+                queue->failed = true;
+            }
+            return;
+        }
+        __atomic_store_n(&connection->lastTimeActive, time(NULL), __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&queue->queuedBytes, result, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&connection->server->bufferedBytes, result, __ATOMIC_RELAXED);
+
+        // release everything that has been sent completely
+        size_t written = result;
+        while (written > 0) {
+            struct sendItem *item = &queue->items[queue->first];
+            size_t remaining = item->length - item->offset;
+            if (written < remaining) {
+                item->offset += written;
                 break;
-            } else {
-                // move all connections above this one one down
-                memmove(handle->connections[i], handle->connections[i+1], sizeof(Connection *) * (handle->numConnections - i - 1 - removedConnections));
-                removedConnections++;
             }
+
+            written -= remaining;
+            send_pop(queue);
+        }
+    }
+}
+
+// drop all pending sends, call with send queue locked
+static void send_queue_clear(Connection *connection) {
+    struct _SendQueue *queue = connection->sendQueue;
+    while (queue->count > 0) {
+        // only buffers count against the budget
+        struct sendItem *item = &queue->items[queue->first];
+        if (item->buffer) {
+            __atomic_sub_fetch(&connection->server->bufferedBytes, item->length - item->offset, __ATOMIC_RELAXED);
         }
+        send_pop(queue);
     }
+    queue->first = 0;
+    __atomic_store_n(&queue->queuedBytes, 0, __ATOMIC_RELAXED);
+}
 
-    // correct connection count
-    handle->numConnections -= removedConnections;
+// check the global send buffer budget, call with send queue locked
+static bool send_budget(Connection *connection, size_t len) {
+    ServerHandle handle = connection->server;
+    if ((handle->maxBufferedBytes == 0) || (__atomic_load_n(&handle->bufferedBytes, __ATOMIC_RELAXED) + len <= handle->maxBufferedBytes)) {
+        return true;
+    }
 
-    pthread_mutex_unlock(&handle->connectionMutex);
+    DebugLog("[SEND:%d] Send buffer budget exhausted, closing connection\n", connection->id);
+    __atomic_add_fetch(&handle->rejectedSends, 1, __ATOMIC_RELAXED);
+    return false;
 }
 
-static void close_connection(ServerHandle handle, Connection *connection) {
-    pthread_mutex_lock(&handle->connectionMutex);
+// send part of a file without blocking, returns the number of bytes sent (0 at the end of the file) or -1
+static ssize_t send_file_chunk(int socket, int fd, off_t *offset, size_t count) {
+#if defined(__APPLE__) && defined(__MACH__)
+    // the socket has SO_NOSIGPIPE set, partial sends fail with EAGAIN
+    off_t length = count;
+    int result = sendfile(fd, socket, *offset, &length, NULL, 0);
+    if ((result < 0) && !((errno == EAGAIN) && (length > 0))) {
+        return -1;
+    }
+    *offset += length;
+    return length;
+#else
+    // sendfile has no MSG_NOSIGNAL, block SIGPIPE for this thread and swallow the one we raised
+    sigset_t pipeMask, oldMask, pending;
+    sigemptyset(&pipeMask);
+    sigaddset(&pipeMask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeMask, &oldMask);
+    sigpending(&pending);
+    bool wasPending = sigismember(&pending, SIGPIPE);
+
+    ssize_t result = sendfile(socket, fd, offset, count);
+    int error = errno;
+    if ((result < 0) && (error == EPIPE) && !wasPending) {
+        struct timespec zero = { 0, 0 };
+        sigtimedwait(&pipeMask, NULL, &zero);
+    }
 
-    // close file descriptor
-    DebugLog("[CLOSE] closing connection %d\n", connection->id);
-    close(connection->fd);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    errno = error;
+    return result;
+#endif
+}
 
-    // remove from open connection list
-    for(int i = 0; i < handle->numConnections; i++) {
-        if (handle->connections[i] == connection) {
-            if (connection->remoteIP) {
-                free(connection->remoteIP);
-                connection->remoteIP = NULL;
+static void write_data(ServerHandle handle, fd_set writable) {
+    epoch_enter();
+    struct connectionTable *table = __atomic_load_n(&handle->connections, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < table->capacity; i++) {
+        Connection *connection = connection_at(table, i);
+        if (connection == NULL) {
+            continue;
+        }
+        if (FD_ISSET(connection->fd, &writable)) {
+            // do not wait for a blocking sender, we will be woken up again
+            if (pthread_mutex_trylock(&connection->sendQueue->mutex) == 0) {
+                send_flush(connection);
+                bool failed = connection->sendQueue->failed;
+                pthread_mutex_unlock(&connection->sendQueue->mutex);
+                if (failed) {
+                    close_connection(handle, connection);
+                }
+            }
+        }
+    }
+    epoch_exit();
+}
+
+// FNV-1a
+static uint32_t group_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for(const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+// call with group list locked
+static struct _Group *find_group(ServerHandle handle, const char *name) {
+    if (handle->groupCapacity == 0) {
+        return NULL;
+    }
+    uint32_t hash = group_hash(name);
+    int slot = hash & (handle->groupCapacity - 1);
+    while (handle->groups[slot]) {
+        struct _Group *g = handle->groups[slot];
+        if ((g->hash == hash) && (strcmp(g->name, name) == 0)) {
+            return g;
+        }
+        slot = (slot + 1) & (handle->groupCapacity - 1);
+    }
+    return NULL;
+}
+
+// add an empty group to the table, call with group list locked
+static struct _Group *create_group(ServerHandle handle, const char *name) {
+    // keep at least half of the slots empty
+    if ((handle->numGroups + 1) * 2 > handle->groupCapacity) {
+        int capacity = (handle->groupCapacity > 0) ? handle->groupCapacity * 2 : GROUP_TABLE_MIN;
+        struct _Group **groups = calloc(capacity, sizeof(struct _Group *));
+        for(int i = 0; i < handle->groupCapacity; i++) {
+            struct _Group *g = handle->groups[i];
+            if (g) {
+                int slot = g->hash & (capacity - 1);
+                while (groups[slot]) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                groups[slot] = g;
             }
+        }
+        free(handle->groups);
+        handle->groups = groups;
+        handle->groupCapacity = capacity;
+    }
+
+    struct _Group *g = calloc(sizeof(struct _Group), 1);
+    g->name = strdup(name);
+    g->hash = group_hash(name);
+    int slot = g->hash & (handle->groupCapacity - 1);
+    while (handle->groups[slot]) {
+        slot = (slot + 1) & (handle->groupCapacity - 1);
+    }
+    handle->groups[slot] = g;
+    handle->numGroups++;
+    return g;
+}
+
+// index of the group in the memberships of a connection, -1 if not a member. Call with group list locked
+static int find_membership(Connection *connection, struct _Group *group) {
+    for(int i = 0; i < connection->numGroups; i++) {
+        if (connection->groups[i].group == group) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// remove a member from a group, order does not matter so the last entries fill the gaps. Call with group list locked
+static void group_remove(struct _Group *group, int slot) {
+    Connection *connection = group->members[slot].connection;
+    int membership = group->members[slot].membership;
+
+    struct _Member last = group->members[--group->numMembers];
+    if (slot != group->numMembers) {
+        group->members[slot] = last;
+        last.connection->groups[last.membership].slot = slot;
+    }
+
+    struct _Membership lastMembership = connection->groups[--connection->numGroups];
+    if (membership != connection->numGroups) {
+        connection->groups[membership] = lastMembership;
+        lastMembership.group->members[lastMembership.slot].membership = membership;
+    }
+}
+
+/*
+ * MARK: - Read scheduling
+ */
+
+// refill a token bucket and return how many of the wanted bytes may be read, sets the throttle time if none
+static size_t bucket_allowance(ServerHandle handle, Connection *connection, double *tokens, uint64_t *lastRefill, size_t wanted, uint64_t now) {
+    if (*lastRefill == 0) {
+        *tokens = handle->rateBurst;
+    } else {
+        *tokens += (double)(now - *lastRefill) * handle->rateLimit / 1000.0;
+        if (*tokens > handle->rateBurst) {
+            *tokens = handle->rateBurst;
+        }
+    }
+    *lastRefill = now;
+
+    if (*tokens >= 1.0) {
+        return ((double)wanted < *tokens) ? wanted : (size_t)*tokens;
+    }
+
+    // wait until there are enough tokens for a full read (or the bucket is full)
+    double needed = ((double)wanted < handle->rateBurst) ? (double)wanted : (double)handle->rateBurst;
+    uint64_t delay = (uint64_t)((needed - *tokens) * 1000.0 / handle->rateLimit) + 1;
+    connection->throttledUntil = now + delay;
+    return 0;
+}
+
+static size_t rate_limit_allowance(ServerHandle handle, Connection *connection, size_t wanted, uint64_t now) {
+    if (handle->rateLimit <= 0) {
+        return wanted;
+    }
+
+    pthread_mutex_lock(&handle->rateLimitMutex);
 
-            if (i == handle->numConnections - 1) {
-                // last one, just decrement connection count
-                handle->numConnections--;
+    // per IP limit, find or create the shared bucket
+    if (handle->rateLimitPerIP && (connection->rateLimit == NULL) && connection->remoteIP) {
+        for(int i = 0; i < handle->numRateLimits; i++) {
+            if (strcmp(handle->rateLimits[i]->remoteIP, connection->remoteIP) == 0) {
+                connection->rateLimit = handle->rateLimits[i];
                 break;
-            } else {
-                // move all connections above this one one down
-                memmove(handle->connections[i], handle->connections[i+1], sizeof(Connection *) * (handle->numConnections - i - 1));
             }
         }
+        if (connection->rateLimit == NULL) {
+            struct _RateLimit *limit = calloc(sizeof(struct _RateLimit), 1);
+            strncpy(limit->remoteIP, connection->remoteIP, sizeof(limit->remoteIP) - 1);
+            handle->rateLimits = realloc(handle->rateLimits, (handle->numRateLimits + 1) * sizeof(struct _RateLimit *));
+            handle->rateLimits[handle->numRateLimits++] = limit;
+            connection->rateLimit = limit;
+        }
+        connection->rateLimit->references++;
     }
 
-    pthread_mutex_unlock(&handle->connectionMutex);
+    size_t allowance;
+    if (connection->rateLimit) {
+        allowance = bucket_allowance(handle, connection, &connection->rateLimit->tokens, &connection->rateLimit->lastRefill, wanted, now);
+    } else {
+        allowance = bucket_allowance(handle, connection, &connection->tokens, &connection->lastRefill, wanted, now);
+    }
+
+    pthread_mutex_unlock(&handle->rateLimitMutex);
+    return allowance;
 }
 
-static void read_data(ServerHandle handle, fd_set readable) {
-    // add all open connections
-    for(int i = 0; i < handle->numConnections; i++) {
-        Connection *connection = handle->connections[i];
-        if (FD_ISSET(connection->fd, &readable)) {
-            connection->receiving = true;
-            connection->lastTimeActive = time(NULL);
-            struct readTaskData *data = malloc(sizeof(struct readTaskData));
-            data->handle = handle;
-            data->connection = connection;
-            queue_add_task(handle->queue, read_task, clean_task, data);
+static void rate_limit_consume(ServerHandle handle, Connection *connection, size_t bytes) {
+    if (handle->rateLimit <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&handle->rateLimitMutex);
+    if (connection->rateLimit) {
+        connection->rateLimit->tokens -= bytes;
+    } else {
+        connection->tokens -= bytes;
+    }
+    pthread_mutex_unlock(&handle->rateLimitMutex);
+}
+
+// free everything a closed connection holds on to
+static void release_connection(ServerHandle handle, Connection *connection) {
+    // drop all pending sends
+    pthread_mutex_lock(&connection->sendQueue->mutex);
+    connection->sendQueue->closed = true;
+    send_queue_clear(connection);
+    pthread_mutex_unlock(&connection->sendQueue->mutex);
+
+    // leave all groups
+    pthread_mutex_lock(&handle->groupMutex);
+    while (connection->numGroups > 0) {
+        struct _Membership *membership = &connection->groups[connection->numGroups - 1];
+        group_remove(membership->group, membership->slot);
+    }
+    pthread_mutex_unlock(&handle->groupMutex);
+
+    if (connection->rateLimit) {
+        pthread_mutex_lock(&handle->rateLimitMutex);
+        if (--connection->rateLimit->references == 0) {
+            for(int i = 0; i < handle->numRateLimits; i++) {
+                if (handle->rateLimits[i] == connection->rateLimit) {
+                    handle->rateLimits[i] = handle->rateLimits[--handle->numRateLimits];
+                    break;
+                }
+            }
+            free(connection->rateLimit);
         }
+        connection->rateLimit = NULL;
+        pthread_mutex_unlock(&handle->rateLimitMutex);
     }
 }
 
-static struct selectMask build_select_mask(ServerHandle handle) {
-    struct selectMask msk;
-    FD_ZERO(&msk.readSet);
+/*
+ * MARK: - Handover
+ */
 
-    // add socket itselt for selecting on 'accept' calls
-    msk.maxFD = (handle->socket > handle->signalPipe[0]) ? handle->socket : handle->signalPipe[0];
-    FD_SET(handle->socket, &msk.readSet);
-    FD_SET(handle->signalPipe[0], &msk.readSet);
+static bool handover_send(int channel, struct handoverRecord *record, int fd) {
+    record->magic = HANDOVER_MAGIC;
+
+    struct iovec iov;
+    iov.iov_base = record;
+    iov.iov_len = sizeof(struct handoverRecord);
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // attach the file descriptor as ancillary data
+    if (fd >= 0) {
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
 
-    // add all open connections
-    pthread_mutex_lock(&handle->connectionMutex);
-    for(int i = 0; i < handle->numConnections; i++) {
-        Connection *connection = handle->connections[i];
-        if (connection->receiving) {
+    ssize_t result;
+    do {
+        result = sendmsg(channel, &msg, 0);
+    } while ((result < 0) && (errno == EINTR));
+
+    if (result != sizeof(struct handoverRecord)) {
+        DebugLog("[HANDOVER] sendmsg call failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static int handover_receive(int channel, struct handoverRecord *record) {
+    memset(record, 0, sizeof(struct handoverRecord));
+
+    struct iovec iov;
+    iov.iov_base = record;
+    iov.iov_len = sizeof(struct handoverRecord);
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t result;
+    do {
+        result = recvmsg(channel, &msg, 0);
+    } while ((result < 0) && (errno == EINTR));
+
+    // fetch the file descriptor from the ancillary data
+    int fd = -1;
+    if (result > 0) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    // read the rest of the record if it was split up
+    size_t bytesRead = (result > 0) ? result : 0;
+    while ((result > 0) && (bytesRead < sizeof(struct handoverRecord))) {
+        result = recv(channel, (char *)record + bytesRead, sizeof(struct handoverRecord) - bytesRead, 0);
+        if ((result < 0) && (errno == EINTR)) {
+            result = 1;
             continue;
         }
-        if (connection->fd > msk.maxFD) {
-            msk.maxFD = connection->fd;
+        if (result > 0) {
+            bytesRead += result;
         }
-        FD_SET(connection->fd, &msk.readSet);
     }
-    pthread_mutex_unlock(&handle->connectionMutex);
 
-    // return the set
-    return msk;
+    if ((bytesRead < sizeof(struct handoverRecord)) || (record->magic != HANDOVER_MAGIC)) {
+        DebugLog("[HANDOVER] Invalid record received\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        record->type = HANDOVER_DONE;
+        return -1;
+    }
+    return fd;
+}
+
+// adopt the next connection the predecessor sent, closes the channel when the handover is done
+static void receive_handover(ServerHandle handle) {
+    struct handoverRecord record;
+    int fd = handover_receive(handle->handoverChannel, &record);
+    if (record.type != HANDOVER_CONNECTION) {
+        DebugLog("[HANDOVER] Predecessor done\n");
+        close(handle->handoverChannel);
+        handle->handoverChannel = -1;
+        return;
+    }
+    if (fd < 0) {
+        return;
+    }
+
+    // the successor may be configured differently
+    disable_sigpipe(fd);
+    if (handle->hasSocketOptions) {
+        apply_socket_options(fd, &handle->socketOptions);
+    }
+    if (handle->busyPollSocket > 0) {
+        enable_busy_poll(fd, handle->busyPollSocket);
+    }
+
+    Connection *conn = create_connection(handle, fd);
+    strncpy(conn->remoteIP, record.remoteIP, 45);
+    conn->remotePort = record.remotePort;
+    DebugLog("[HANDOVER] Adopted connection %d (was %d) from %s:%d\n", conn->id, record.id, conn->remoteIP, conn->remotePort);
+    add_connection(handle, conn);
 }
 
 /*
@@ -539,36 +2743,203 @@ static struct selectMask build_select_mask(ServerHandle handle) {
 
 void read_task(void *data) {
     struct readTaskData *info = (struct readTaskData *)data;
-    char buffer[4096];
+    ServerHandle handle = info->handle;
+    Connection *connection = info->connection;
+    char buffer[READ_BUFFER_SIZE + 1];
+
+    // new turn, add a quantum to the budget of this connection (deficit round robin)
+    connection->deficit += handle->readQuantum;
+    if (connection->deficit > 2 * handle->readQuantum) {
+        connection->deficit = 2 * handle->readQuantum;
+    }
+
+    int messages = 0;
+    while ((connection->deficit > 0) && (messages < handle->readMessages)) {
+        size_t wanted = (connection->deficit < READ_BUFFER_SIZE) ? connection->deficit : READ_BUFFER_SIZE;
+        wanted = rate_limit_allowance(handle, connection, wanted, now_ms());
+        if (wanted == 0) {
+            // throttled, the listener will schedule us again when there are tokens
+            DebugLog("[READ] connection %d throttled\n", connection->id);
+            break;
+        }
+
+        ssize_t bytesRead = connection_read(connection, buffer, wanted);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-    ssize_t bytesRead;
-    do {
-        bytesRead = read(info->connection->fd, buffer, 4096);
-        if ((bytesRead < 0) && (errno != EINTR)) {
             // unrecoverable error
             if (errno != EAGAIN) {
                 DebugLog("[READ] error: %s\n", strerror(errno));
-                close_connection(info->handle, info->connection);
+                close_connection(handle, connection);
             }
-            info->connection->receiving = false;
-            return;
+
+            // nothing left to read, unused budget does not carry over
+            connection->deficit = 0;
+            break;
         } else if (bytesRead == 0) {
             // end of file, aka connection closed
             DebugLog("[READ] EOF, closing connection\n");
-            close_connection(info->handle, info->connection);
-            return;
+            close_connection(handle, connection);
+            break;
+        }
+
+        rate_limit_consume(handle, connection, bytesRead);
+        if (handle->capture) {
+            capture_write(handle->capture, connection->id, CAPTURE_IN, buffer, bytesRead);
         }
-    } while (bytesRead < 0);
+        connection->deficit -= bytesRead;
+        messages++;
+
+        buffer[bytesRead] = 0;
+        DebugLog("[READ] read %d bytes\n", (int)bytesRead);
+        ReceiveResult result;
+        if (handle->onReceiveAsync) {
+            // the token is live from now on, it may be used before the callback returns
+            if (++connection->request == 0) {
+                // 0 marks no pending request
+                connection->request = 1;
+            }
+            ResumeToken token = { handle, connection->id, connection->request };
+            __atomic_store_n(&connection->pendingRequest, token.request, __ATOMIC_SEQ_CST);
+            __atomic_fetch_or(&connection->state, CONNECTION_PENDING, __ATOMIC_SEQ_CST);
+            result = handle->onReceiveAsync(connection, handle->userData, buffer, bytesRead, token);
+            if (result == RECEIVE_PENDING) {
+                // hand the connection to the resumer, unless it already has been resumed
+                uint32_t state = __atomic_fetch_or(&connection->state, CONNECTION_SUSPENDED, __ATOMIC_SEQ_CST);
+                if (state & CONNECTION_PENDING) {
+                    DebugLog("[READ] connection %d suspended\n", connection->id);
+                    return;
+                }
+                __atomic_fetch_and(&connection->state, ~CONNECTION_SUSPENDED, __ATOMIC_SEQ_CST);
+                break;
+            }
+
+            // finished synchronously, the token is void
+            uint32_t request = token.request;
+            __atomic_compare_exchange_n(&connection->pendingRequest, &request, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            __atomic_fetch_and(&connection->state, ~CONNECTION_PENDING, __ATOMIC_SEQ_CST);
+        } else {
+            result = handle->onReceive(connection, handle->userData, buffer, bytesRead) ? RECEIVE_CONTINUE : RECEIVE_CLOSE;
+        }
+        if (result == RECEIVE_CLOSE) {
+            DebugLog("[READ] closing connection upon request\n");
+            close_connection(handle, connection);
+            break;
+        }
+
+        // short read, socket buffer is empty
+        if ((size_t)bytesRead < wanted) {
+            connection->deficit = 0;
+            break;
+        }
+    }
+
+    // finish a close that happened while reading
+    if (end_receive(handle, connection) && !info->inlined) {
+        wake_listener(handle);
+    }
+}
+
+void read_expired(void *data) {
+    struct readTaskData *info = (struct readTaskData *)data;
 
-    buffer[bytesRead] = 0;
-    DebugLog("[READ] read %d bytes\n", (int)bytesRead);
-    bool keepConnection = info->handle->onReceive(info->connection, info->handle->userData, buffer, bytesRead);
+    // let the user decide what to do with the connection, data stays in the socket buffer
+    bool keepConnection = true;
+    if (info->handle->onExpired) {
+        keepConnection = info->handle->onExpired(info->connection, info->handle->userData);
+    }
     if (!keepConnection) {
-        DebugLog("[READ] closing connection upon request\n");
+        DebugLog("[READ] read expired, closing connection\n");
         close_connection(info->handle, info->connection);
     }
-    info->connection->receiving = false;
-    write(info->handle->signalPipe[1], "x", 1);
+    if (end_receive(info->handle, info->connection)) {
+        wake_listener(info->handle);
+    }
+}
+
+void batch_task(void *data) {
+    struct batchTaskData *info = (struct batchTaskData *)data;
+    ServerHandle handle = info->handle;
+    size_t quantum = (handle->readQuantum < READ_BUFFER_SIZE) ? handle->readQuantum : READ_BUFFER_SIZE;
+
+    // read one message from every connection
+    char *buffers = malloc(info->count * (READ_BUFFER_SIZE + 1));
+    ReceivedMessage *messages = malloc(info->count * sizeof(ReceivedMessage));
+    int numMessages = 0;
+    for(int i = 0; i < info->count; i++) {
+        Connection *connection = info->connections[i];
+        char *buffer = buffers + numMessages * (READ_BUFFER_SIZE + 1);
+
+        size_t wanted = rate_limit_allowance(handle, connection, quantum, now_ms());
+        if (wanted == 0) {
+            DebugLog("[READ] connection %d throttled\n", connection->id);
+            continue;
+        }
+
+        ssize_t bytesRead;
+        do {
+            bytesRead = connection_read(connection, buffer, wanted);
+        } while ((bytesRead < 0) && (errno == EINTR));
+
+        if (bytesRead < 0) {
+            if (errno != EAGAIN) {
+                DebugLog("[READ] error: %s\n", strerror(errno));
+                close_connection(handle, connection);
+            }
+            continue;
+        } else if (bytesRead == 0) {
+            DebugLog("[READ] EOF, closing connection\n");
+            close_connection(handle, connection);
+            continue;
+        }
+
+        rate_limit_consume(handle, connection, bytesRead);
+        if (handle->capture) {
+            capture_write(handle->capture, connection->id, CAPTURE_IN, buffer, bytesRead);
+        }
+        buffer[bytesRead] = 0;
+
+        messages[numMessages].connection = connection;
+        messages[numMessages].data = buffer;
+        messages[numMessages].size = bytesRead;
+        messages[numMessages].keepConnection = true;
+        numMessages++;
+    }
+
+    // deliver all of them at once
+    if (numMessages > 0) {
+        DebugLog("[READ] delivering batch of %d messages\n", numMessages);
+        handle->onReceiveBatch(messages, numMessages, handle->userData);
+    }
+    for(int i = 0; i < numMessages; i++) {
+        if (!messages[i].keepConnection) {
+            DebugLog("[READ] closing connection upon request\n");
+            close_connection(handle, messages[i].connection);
+        }
+    }
+    free(messages);
+    free(buffers);
+
+    // finish all reads, wake the listener once
+    bool wake = false;
+    for(int i = 0; i < info->count; i++) {
+        wake |= end_receive(handle, info->connections[i]);
+    }
+    if (wake && !info->inlined) {
+        wake_listener(handle);
+    }
+}
+
+void batch_expired(void *data) {
+    struct batchTaskData *info = (struct batchTaskData *)data;
+
+    // expire every connection of the batch on its own
+    for(int i = 0; i < info->count; i++) {
+        struct readTaskData task = { info->handle, info->connections[i], info->inlined };
+        read_expired(&task);
+    }
 }
 
 void clean_task(void *data) {
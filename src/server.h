@@ -14,27 +14,146 @@
 #include <stdlib.h>
 #include <time.h>
 
-/** Connection identifier */
+#include "queue.h"
+#include "epoch.h"
+
+/** Connection state flags */
+#define CONNECTION_RECEIVING 0x1 /**< a reader owns the connection */
+#define CONNECTION_SENDING   0x2 /**< blocking send in progress */
+#define CONNECTION_CLOSED    0x4 /**< connection is closing, do not use anymore */
+#define CONNECTION_PENDING   0x8 /**< async receive callback has not resumed the connection yet */
+#define CONNECTION_SUSPENDED 0x10 /**< the reader returned, `server_connection_resume` finishes the read */
+
+/** Connection identifier
+ *
+ * Connections are freed through epoch based reclamation. Inside callbacks the connection
+ * is always valid, everywhere else wrap the use of a connection pointer in `epoch_enter`
+ * and `epoch_exit`.
+ */
 typedef struct _Connection {
 	int id;         /**< Connection ID */
 
 	char *remoteIP; /**< Remote IP address */
 	int remotePort; /**< Remote port */
+    queue_priority priority; /**< Scheduling priority of reads, may be changed from within callbacks */
 
     // internal
     int fd;         /**< Socket handle */
-    bool sending;   /**< currently sending data */
-    bool receiving; /**< currently receiving data */
+    uint32_t state; /**< connection state flags, only changed atomically */
+    uint32_t request;        /**< generation of the last async request, only changed by the reader */
+    uint32_t pendingRequest; /**< generation of the async request waiting to be resumed, 0 if none */
+
+    time_t lastTimeActive; /**< last time the socket has received or sent data, only accessed atomically */
 
-    time_t lastTimeActive; /**< last time the socket has received or sent data */
+    int deficit;             /**< read budget in bytes carried over from the last turn */
+    double tokens;           /**< rate limit token bucket fill level in bytes */
+    uint64_t lastRefill;     /**< last time the token bucket was refilled (monotonic ms) */
+    uint64_t throttledUntil; /**< rate limited, do not read before this time (monotonic ms) */
+    struct _RateLimit *rateLimit; /**< token bucket shared by all connections of the same remote IP */
+    struct _SendQueue *sendQueue; /**< data waiting for the socket to become writable */
+    struct _Membership *groups;   /**< broadcast groups this connection is a member of */
+    int numGroups;
+    int allocatedGroups;
+    struct _shm_channel *shm;     /**< shared memory channel, NULL for network connections */
+    struct _ServerHandle *server; /**< server this connection belongs to */
 } Connection;
 
+/** Reference counted immutable send buffer */
+typedef struct _SharedBuffer SharedBuffer;
+
+/** Version of the `ServerConfig` struct this header defines */
+#define SERVER_CONFIG_VERSION 2
+
+/** Socket tuning options, set an option to -1 to keep the system default */
+typedef struct _SocketOptions {
+    int noDelay;           /**< TCP_NODELAY, set to 1 to disable Nagle's algorithm */
+    int receiveBuffer;     /**< SO_RCVBUF in bytes */
+    int sendBuffer;        /**< SO_SNDBUF in bytes */
+    int keepAlive;         /**< SO_KEEPALIVE, set to 1 to enable keep alive probes */
+    int keepAliveIdle;     /**< TCP_KEEPIDLE, seconds of idle time before the first keep alive probe */
+    int keepAliveInterval; /**< TCP_KEEPINTVL, seconds between keep alive probes */
+    int keepAliveCount;    /**< TCP_KEEPCNT, unanswered probes before the connection is dropped */
+    int userTimeout;       /**< TCP_USER_TIMEOUT, milliseconds sent data may stay unacknowledged (Linux only) */
+    int linger;            /**< SO_LINGER, seconds to linger on close */
+    int notSentLowat;      /**< TCP_NOTSENT_LOWAT, bytes of unsent data before the socket stops being writable */
+} SocketOptions;
+
+/** Server configuration, initialize with `server_config_init` */
+typedef struct _ServerConfig {
+    int version;              /**< struct version, `SERVER_CONFIG_VERSION` */
+
+    const char *listenIP;     /**< Textual form of IP interface to listen on (use "*" for wildcard) */
+    const char *port;         /**< port number or name */
+    bool v4Only;              /**< set to true to listen only on IPv4 sockets */
+    int timeout;              /**< socket idle timeout in seconds */
+
+    int backlog;              /**< length of the listen queue, 0 for the system maximum */
+    int deferAccept;          /**< TCP_DEFER_ACCEPT timeout in seconds, 0 to disable (Linux only) */
+    int fastOpen;             /**< TCP fast open queue length, 0 to disable */
+    queue_priority acceptPriority; /**< scheduling priority of new connections */
+
+    SocketOptions socketOptions; /**< applied to the listener and inherited by each connection */
+
+    // Version 2
+    int busyPoll;             /**< busy poll mode: spin this many microseconds before sleeping and run receive callbacks on the listener thread, 0 to disable */
+    int busyPollSocket;       /**< SO_BUSY_POLL microseconds for accepted connections, also sets SO_PREFER_BUSY_POLL (Linux only), 0 to disable */
+} ServerConfig;
+
+/** Resource usage and admission counters, see `server_get_stats` */
+typedef struct _ServerStats {
+    int connections;              /**< open connections */
+    int queuedTasks;              /**< reads waiting for a worker */
+    int workers;                  /**< running worker threads */
+    size_t bufferedBytes;         /**< data waiting in send queues */
+
+    uint64_t accepted;            /**< connections accepted */
+    uint64_t rejectedConnections; /**< connections closed right after accept because of the connection limit */
+    uint64_t shedConnections;     /**< idle connections closed to make room for new ones */
+    uint64_t deferredReads;       /**< reads postponed because too many tasks were queued */
+    uint64_t rejectedSends;       /**< sends refused because of the buffer limit, the connection was closed */
+} ServerStats;
+
 /** Opaque server handle */
 typedef struct _ServerHandle *ServerHandle;
 
 /** Data Receive callback, return false if you want the server to terminate the connection */
 typedef bool (*ReceiveCallback)(Connection *connection, void *userData, const char *data, size_t size);
 
+/** Result of an async receive callback */
+typedef enum _ReceiveResult {
+    RECEIVE_CLOSE = 0,  /**< terminate the connection */
+    RECEIVE_CONTINUE,   /**< keep the connection and continue reading */
+    RECEIVE_PENDING     /**< request still running, the connection is resumed with `server_connection_resume` */
+} ReceiveResult;
+
+/** Completion token of an async receive callback, may be copied to any thread */
+typedef struct _ResumeToken {
+    ServerHandle server; /**< server the connection belongs to */
+    int connectionID;    /**< ID of the suspended connection */
+    uint32_t request;    /**< generation of the suspended request, the token is void once it has been resumed */
+} ResumeToken;
+
+/** Async data receive callback
+ *
+ * Return `RECEIVE_PENDING` to release the worker without finishing the request. The connection
+ * is not read from and not closed for idleness until it is resumed with the token.
+ */
+typedef ReceiveResult (*AsyncReceiveCallback)(Connection *connection, void *userData, const char *data, size_t size, ResumeToken token);
+
+/** One message of a batch */
+typedef struct _ReceivedMessage {
+    Connection *connection; /**< connection the data was read from */
+    const char *data;       /**< received data, zero terminated, only valid during the callback */
+    size_t size;            /**< length of the data */
+    bool keepConnection;    /**< set to false to terminate the connection */
+} ReceivedMessage;
+
+/** Batch receive callback, gets the data of many connections at once */
+typedef void (*BatchReceiveCallback)(ReceivedMessage *messages, int count, void *userData);
+
+/** Read expiry callback, called when a read waited longer than the read deadline, return false to terminate the connection */
+typedef bool (*ExpiredCallback)(Connection *connection, void *userData);
+
 /** Initialize server
  *
  * @param listenIP: Textual form of IP interface to listen on (use "*" for wildcard)
@@ -44,20 +163,272 @@ typedef bool (*ReceiveCallback)(Connection *connection, void *userData, const ch
  */
 ServerHandle server_init(const char *listenIP, const char *port, bool v4Only, int timeout);
 
+/** Initialize socket options to keep all system defaults
+ *
+ * @param options: options to initialize
+ */
+void server_socket_options_init(SocketOptions *options);
+
+/** Initialize a server configuration with default values
+ *
+ * @param config: configuration to initialize
+ * @param listenIP: Textual form of IP interface to listen on (use "*" for wildcard)
+ * @param port: port number or name
+ */
+void server_config_init(ServerConfig *config, const char *listenIP, const char *port);
+
+/** Initialize server with extended configuration
+ *
+ * @param config: server configuration (see `server_config_init`)
+ */
+ServerHandle server_init_ex(const ServerConfig *config);
+
+/** Initialize server from a listening socket handed over by a running predecessor
+ *
+ * Blocks until the predecessor calls `server_handover` with the same path and returns as soon as
+ * the listening socket arrived, start the server right away to accept. Connections the predecessor
+ * hands over after draining are adopted by the listener thread once the server is started.
+ *
+ * @param path: filesystem path of the unix socket to wait on for the handover
+ * @param timeout: socket idle timeout in seconds (close socket when not receiving data for this amount of time)
+ */
+ServerHandle server_init_handover(const char *path, int timeout);
+
+/** Initialize server from a handed over listening socket with extended configuration
+ *
+ * Like `server_init_handover`, but listen queue settings, accept priority, socket options and busy
+ * poll settings are taken from the configuration. Socket options are applied to the listener and all
+ * adopted connections, `listenIP`, `port` and `v4Only` are ignored.
+ *
+ * @param path: filesystem path of the unix socket to wait on for the handover
+ * @param config: server configuration (see `server_config_init`)
+ */
+ServerHandle server_init_handover_ex(const char *path, const ServerConfig *config);
+
 /** Start a server
  *
  * @param handle: Server handle
+ * @param onReceive: data receive callback
+ * @param userData: user data given to the receive callback verbatim
+ * @param workerCount: number of parallel worker threads
  */
-
 bool server_start(ServerHandle handle, ReceiveCallback onReceive, void *userData, int workerCount);
 
+/** Start a server with an elastic worker pool
+ *
+ * @param handle: Server handle
+ * @param onReceive: data receive callback
+ * @param userData: user data given to the receive callback verbatim
+ * @param pool: worker pool configuration (see `queue_config_init`)
+ */
+bool server_start_pool(ServerHandle handle, ReceiveCallback onReceive, void *userData, const queue_config *pool);
+
+/** Start a server with an async receive callback
+ *
+ * Handlers that wait on other services return `RECEIVE_PENDING` and resume the connection
+ * when done, so the worker count does not have to match the number of requests in flight.
+ *
+ * @param handle: Server handle
+ * @param onReceive: async data receive callback
+ * @param userData: user data given to the receive callback verbatim
+ * @param pool: worker pool configuration (see `queue_config_init`)
+ */
+bool server_start_async(ServerHandle handle, AsyncReceiveCallback onReceive, void *userData, const queue_config *pool);
+
+/** Start a server with a batch receive callback
+ *
+ * All connections that became readable in one iteration of the event loop are read in one
+ * task and delivered in one callback, split into batches of at most `maxBatch` messages.
+ * Every connection gets at most one message per batch.
+ *
+ * @param handle: Server handle
+ * @param onReceive: batch receive callback
+ * @param userData: user data given to the receive callback verbatim
+ * @param maxBatch: maximum number of messages per callback
+ * @param pool: worker pool configuration (see `queue_config_init`)
+ */
+bool server_start_batch(ServerHandle handle, BatchReceiveCallback onReceive, void *userData, int maxBatch, const queue_config *pool);
+
+/** Resume a connection suspended by an async receive callback, may be called from any thread
+ *
+ * Send the response before resuming, look the connection up with `server_connection_lookup`
+ * using the token. Pending connections keep `server_drain` and `server_handover` waiting
+ * for up to the server timeout, then the requests are expired and their connections closed.
+ * Do not resume after `server_stop`.
+ *
+ * @param token: token the callback got
+ * @param keepConnection: false to terminate the connection
+ * @return false if the token is stale or has already been used, a token never resumes a later request
+ */
+bool server_connection_resume(ResumeToken token, bool keepConnection);
+
+/** Set listening socket options, call before `server_start`
+ *
+ * @param handle: Server handle
+ * @param backlog: length of the listen queue, 0 for the system maximum (default)
+ * @param deferAccept: only accept connections after the client sent data, timeout in seconds, 0 to disable (Linux only)
+ * @param fastOpen: TCP fast open queue length, 0 to disable
+ */
+void server_set_listen_options(ServerHandle handle, int backlog, int deferAccept, int fastOpen);
+
+/** Set the priority new connections are tagged with when they are accepted
+ *
+ * @param handle: Server handle
+ * @param priority: scheduling priority for reads of new connections
+ */
+void server_set_accept_priority(ServerHandle handle, queue_priority priority);
+
+/** Set a deadline for reads
+ *
+ * Reads that could not be started by a worker within the deadline are not executed,
+ * the data stays in the socket buffer and `onExpired` decides if the connection is kept.
+ *
+ * @param handle: Server handle
+ * @param deadline: deadline in milliseconds, 0 to disable
+ * @param onExpired: optional expiry callback, if NULL the connection is kept
+ */
+void server_set_read_deadline(ServerHandle handle, int deadline, ExpiredCallback onExpired);
+
+/** Set the read budget of a connection
+ *
+ * Every time a readable connection is scheduled it may read up to `quantum` bytes in at most
+ * `maxMessages` receive callbacks. Budget that was not used because the limit on callbacks was
+ * hit carries over to the next turn (deficit round robin). Default is 4096 bytes in one callback.
+ *
+ * @param handle: Server handle
+ * @param quantum: bytes a connection may read per turn
+ * @param maxMessages: receive callbacks a connection may get per turn
+ */
+void server_set_read_budget(ServerHandle handle, int quantum, int maxMessages);
+
+/** Limit the rate connections may send data to the server
+ *
+ * Connections that ran out of tokens are not read from until the token bucket is refilled.
+ *
+ * @param handle: Server handle
+ * @param bytesPerSecond: token bucket refill rate, 0 to disable
+ * @param burst: token bucket size in bytes, 0 for one second worth of data
+ * @param perIP: share one token bucket between all connections of the same remote IP
+ */
+void server_set_rate_limit(ServerHandle handle, int bytesPerSecond, int burst, bool perIP);
+
+/** Limit resource usage of the server, all limits default to 0 (no limit)
+ *
+ * Above `softConnections` the oldest idle connection (quiet for a quarter of the timeout) is closed
+ * for every new one, if there is none the new connection is closed right after accept, as it is at
+ * `maxConnections`. While `maxQueuedTasks`
+ * reads are waiting for a worker no new reads are started, the data stays in the socket buffers.
+ * Connections that would grow the send queues of all connections above `maxBufferedBytes`
+ * are closed.
+ *
+ * @param handle: Server handle
+ * @param maxConnections: hard connection limit
+ * @param softConnections: connection count above which idle connections are shed
+ * @param maxQueuedTasks: maximum number of queued reads
+ * @param maxBufferedBytes: maximum number of bytes in all send queues
+ */
+void server_set_limits(ServerHandle handle, int maxConnections, int softConnections, int maxQueuedTasks, size_t maxBufferedBytes);
+
+/** Capture all traffic to a memory mapped log, call before `server_start`
+ *
+ * Connection open and close events and all received and sent data are appended with a
+ * timestamp. The log is finished by `server_stop`, use the `replay` tool to play it back.
+ *
+ * @param handle: Server handle
+ * @param path: file to write the log to
+ * @param maxSize: maximum size of the log, events that do not fit are dropped
+ * @param snapLength: maximum bytes of data stored per event, 0 to store only the lengths
+ * @return false if the log could not be created
+ */
+bool server_set_capture(ServerHandle handle, const char *path, size_t maxSize, size_t snapLength);
+
+/** Accept local clients over shared memory rings, call before `server_start`
+ *
+ * Clients connect to a unix socket at `path` with `shm_client_connect` and receive a mapping
+ * with one ring per direction. Their data is delivered to the same callbacks as network data
+ * and `server_send_data` writes into the ring. Linux only.
+ *
+ * @param handle: Server handle
+ * @param path: filesystem path of the unix socket to create
+ * @param ringSize: size of each ring in bytes
+ * @return false if the socket could not be created
+ */
+bool server_enable_shm(ServerHandle handle, const char *path, size_t ringSize);
+
+/** Fetch current resource usage and admission counters
+ *
+ * @param handle: Server handle
+ * @param stats: filled with the current values
+ */
+void server_get_stats(ServerHandle handle, ServerStats *stats);
+
+/** Fetch number of currently running worker threads
+ *
+ * @param handle: Server handle
+ * @return number of worker threads
+ */
+int server_worker_count(ServerHandle handle);
+
 /** Stop a server
  *
  * @param handle: Server to stop
  */
 void server_stop(ServerHandle handle);
 
+/** Drain a server
+ *
+ * Stops accepting new connections, waits for all in-flight reads to finish and for queued data to be
+ * sent (at most the idle timeout) and closes all connections.
+ * The server still has to be stopped with `server_stop` afterwards.
+ *
+ * @param handle: Server to drain
+ */
+void server_drain(ServerHandle handle);
+
+/** Hand the listening socket over to a successor process
+ *
+ * The listening socket is sent first and accepting only stops after that, the successor accepts from the
+ * shared listen queue while this server is drained. Call `server_stop` afterwards to release the handle.
+ *
+ * @param handle: Server to hand over
+ * @param path: filesystem path of the unix socket the successor waits on (see `server_init_handover`)
+ * @param includeConnections: set to true to hand over open connections too, else they are closed. Queued
+ *        data is sent first, connections that could not be flushed within the idle timeout are closed
+ * @return true if the handover succeeded
+ */
+bool server_handover(ServerHandle handle, const char *path, bool includeConnections);
+
+/** Close a connection, may be called from within callbacks and from other threads
+ *
+ * Only marks the connection and takes no global lock, the listener thread unlinks and frees it.
+ * If a read is running on the connection the close is finished when it returns.
+ *
+ * @param connection: the connection to close
+ */
+void server_close_connection(Connection *connection);
+
+/** Find an open connection by its ID
+ *
+ * Call between `epoch_enter` and `epoch_exit`, the result is valid until `epoch_exit`.
+ *
+ * @param handle: Server handle
+ * @param id: connection ID
+ * @return the connection or NULL if there is no open connection with that ID
+ */
+Connection *server_connection_lookup(ServerHandle handle, int id);
+
+/** Override socket options of a single connection, may be called from within callbacks
+ *
+ * @param connection: the connection to change
+ * @param options: options to set, options set to -1 are not changed
+ * @return true if all options could be set
+ */
+bool server_connection_set_options(Connection *connection, const SocketOptions *options);
+
 /** Send data back to the connected client
+ *
+ * Never blocks on network connections, what the socket does not take right away is copied
+ * into the send queue and sent by the listener thread when the socket becomes writable.
  *
  * @param connection: the connection to send the data to
  * @param data: data to send
@@ -65,7 +436,72 @@ void server_stop(ServerHandle handle);
  */
 void server_send_data(Connection *connection, const char *data, size_t len);
 
+/** Create a shared send buffer
+ *
+ * The data is copied once, the buffer starts with a reference count of one.
+ *
+ * @param data: data to send
+ * @param len: length of the data
+ * @return new buffer, release with `server_buffer_release`
+ */
+SharedBuffer *server_buffer_create(const char *data, size_t len);
+
+/** Increment the reference count of a shared buffer
+ *
+ * @param buffer: buffer to retain
+ * @return the buffer
+ */
+SharedBuffer *server_buffer_retain(SharedBuffer *buffer);
+
+/** Decrement the reference count of a shared buffer, frees the buffer when it drops to zero
+ *
+ * @param buffer: buffer to release
+ */
+void server_buffer_release(SharedBuffer *buffer);
+
+/** Send a shared buffer to multiple connections
+ *
+ * The buffer is queued on every connection without copying and retained until the last send
+ * completed. Data the sockets do not take immediately is sent by the listener thread, so this
+ * call does not block on slow clients.
+ *
+ * @param handle: Server handle
+ * @param buffer: the data to send
+ * @param connections: connections to send the data to
+ * @param count: number of connections
+ * @return number of connections the buffer was queued on
+ */
+int server_broadcast(ServerHandle handle, SharedBuffer *buffer, Connection **connections, int count);
+
+/** Add a connection to a named broadcast group, connections leave all groups when they are closed
+ *
+ * @param handle: Server handle
+ * @param group: name of the group, created if it does not exist
+ * @param connection: connection to add
+ * @return false if the connection already was a member
+ */
+bool server_group_join(ServerHandle handle, const char *group, Connection *connection);
+
+/** Remove a connection from a named broadcast group
+ *
+ * @param handle: Server handle
+ * @param group: name of the group
+ * @param connection: connection to remove
+ */
+void server_group_leave(ServerHandle handle, const char *group, Connection *connection);
+
+/** Send a shared buffer to all members of a broadcast group
+ *
+ * @param handle: Server handle
+ * @param group: name of the group
+ * @param buffer: the data to send
+ * @return number of connections the buffer was queued on
+ */
+int server_broadcast_group(ServerHandle handle, const char *group, SharedBuffer *buffer);
+
 /** Send a file back to the connected client
+ *
+ * The file is queued behind pending data and sent with `sendfile` whenever the socket is writable.
  *
  * @param connection: the connection to send the data to
  * @param filename: path to the file to send
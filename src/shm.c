@@ -0,0 +1,534 @@
+//
+//  shm.c
+//  UnchainedSocket
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "debug.h"
+#include "shm.h"
+#include "shm_private.h"
+
+static bool unix_address(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+int shm_socket_listen(const char *path, int backlog) {
+	struct sockaddr_un addr;
+	if (!unix_address(&addr, path)) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	// owner only, nobody can connect before listen so there is no window with other permissions
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) || chmod(path, S_IRUSR | S_IWUSR) || listen(fd, backlog)) {
+		int error = errno;
+		close(fd);
+		unlink(path);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+int shm_socket_connect(const char *path) {
+	struct sockaddr_un addr;
+	if (!unix_address(&addr, path)) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un))) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+#if defined(__linux__)
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+// ring sizes are clamped to this range
+#define SHM_MIN_RING_SIZE 4096
+#define SHM_MAX_RING_SIZE (1 << 30)
+
+// producer spins this often before it starts sleeping on a full ring
+#define SHM_SPIN_COUNT 100
+
+enum shm_role {
+	SHM_SERVER = 0,
+	SHM_CLIENT
+};
+
+// one direction, counters only grow, fields of both sides on their own cache line
+struct shm_ring {
+	uint64_t head;        // written by the producer
+	char pad0[56];
+	uint64_t tail;        // written by the consumer
+	char pad1[56];
+	uint32_t waiting;     // consumer sleeps, producer has to ring the doorbell
+	char pad2[60];
+};
+
+// start of the mapping, ring data follows
+struct shm_region {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t ring_size;
+	uint32_t closed[2];   // indexed by role
+	char pad[40];
+
+	struct shm_ring rings[2]; // 0: client to server, 1: server to client
+};
+
+// handshake message, sent along with the memfd and both eventfds
+struct shm_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t ring_size;
+};
+
+struct _shm_channel {
+	struct shm_region *region;
+	size_t map_size;
+	int role;
+
+	struct shm_ring *in;  // ring we consume
+	char *in_data;
+	uint64_t in_tail;     // private copy, the peer may write anything to the mapping
+	struct shm_ring *out; // ring we produce
+	char *out_data;
+	uint64_t out_head;    // private copy
+	uint64_t mask;        // ring size - 1
+
+	int bell;             // our doorbell, rung by the peer
+	int peer_bell;        // doorbell of the peer
+};
+
+static shm_channel shm_map(int memfd, uint64_t ring_size, int role, int bell, int peer_bell) {
+	size_t map_size = sizeof(struct shm_region) + 2 * ring_size;
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED) {
+		DebugLog("[SHM] Could not map channel: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	shm_channel channel = calloc(sizeof(struct _shm_channel), 1);
+	channel->region = (struct shm_region *)map;
+	channel->map_size = map_size;
+	channel->role = role;
+	channel->mask = ring_size - 1;
+	channel->bell = bell;
+	channel->peer_bell = peer_bell;
+
+	char *data = (char *)map + sizeof(struct shm_region);
+	int in = (role == SHM_SERVER) ? 0 : 1;
+	channel->in = &channel->region->rings[in];
+	channel->in_data = data + in * ring_size;
+	channel->out = &channel->region->rings[1 - in];
+	channel->out_data = data + (1 - in) * ring_size;
+
+	return channel;
+}
+
+static void shm_ring_bell(int fd) {
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(uint64_t)) < 0) {
+		// counter overflow is impossible, the peer is gone otherwise
+	}
+}
+
+shm_channel shm_server_accept(int unix_socket, size_t ring_size) {
+	// rings have to be a power of two for the index mask
+	uint64_t size = SHM_MIN_RING_SIZE;
+	while ((size < ring_size) && (size < SHM_MAX_RING_SIZE)) {
+		size <<= 1;
+	}
+
+	int memfd = memfd_create("unchained-shm", MFD_CLOEXEC);
+	if (memfd < 0) {
+		DebugLog("[SHM] memfd_create call failed: %s\n", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(memfd, sizeof(struct shm_region) + 2 * size)) {
+		DebugLog("[SHM] Could not size channel: %s\n", strerror(errno));
+		close(memfd);
+		return NULL;
+	}
+	int bells[2];
+	bells[SHM_SERVER] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	bells[SHM_CLIENT] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((bells[SHM_SERVER] < 0) || (bells[SHM_CLIENT] < 0)) {
+		DebugLog("[SHM] eventfd call failed: %s\n", strerror(errno));
+		close(memfd);
+		if (bells[SHM_SERVER] >= 0) {
+			close(bells[SHM_SERVER]);
+		}
+		if (bells[SHM_CLIENT] >= 0) {
+			close(bells[SHM_CLIENT]);
+		}
+		return NULL;
+	}
+
+	shm_channel channel = shm_map(memfd, size, SHM_SERVER, bells[SHM_SERVER], bells[SHM_CLIENT]);
+	if (channel == NULL) {
+		close(memfd);
+		close(bells[SHM_SERVER]);
+		close(bells[SHM_CLIENT]);
+		return NULL;
+	}
+	channel->region->magic = SHM_MAGIC;
+	channel->region->version = SHM_VERSION;
+	channel->region->ring_size = size;
+
+	// both consumers start out sleeping so the first write rings the bell
+	channel->region->rings[0].waiting = 1;
+	channel->region->rings[1].waiting = 1;
+
+	// send the mapping and both doorbells to the client
+	struct shm_hello hello = { SHM_MAGIC, SHM_VERSION, size };
+	int fds[3] = { memfd, bells[SHM_SERVER], bells[SHM_CLIENT] };
+
+	struct iovec iov;
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(struct shm_hello);
+
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t result;
+	do {
+		result = sendmsg(unix_socket, &msg, MSG_NOSIGNAL);
+	} while ((result < 0) && (errno == EINTR));
+
+	// the mapping keeps the memory alive
+	close(memfd);
+
+	if (result != sizeof(struct shm_hello)) {
+		DebugLog("[SHM] Handshake failed: %s\n", strerror(errno));
+		shm_channel_close(channel);
+		return NULL;
+	}
+	return channel;
+}
+
+shm_channel shm_client_connect(const char *path) {
+	int unix_socket = shm_socket_connect(path);
+	if (unix_socket < 0) {
+		return NULL;
+	}
+
+	// wait for the mapping and the doorbells
+	struct shm_hello hello;
+	memset(&hello, 0, sizeof(struct shm_hello));
+	struct iovec iov;
+	iov.iov_base = &hello;
+	iov.iov_len = sizeof(struct shm_hello);
+
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	ssize_t result;
+	do {
+		result = recvmsg(unix_socket, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while ((result < 0) && (errno == EINTR));
+	close(unix_socket);
+
+	int fds[3] = { -1, -1, -1 };
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) && (cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))) {
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	}
+
+	// validate what we got
+	struct stat st;
+	bool valid = (result == sizeof(struct shm_hello)) && (hello.magic == SHM_MAGIC) && (hello.version == SHM_VERSION) &&
+				 (fds[0] >= 0) && (fds[1] >= 0) && (fds[2] >= 0) && (hello.ring_size >= SHM_MIN_RING_SIZE) &&
+				 (hello.ring_size <= SHM_MAX_RING_SIZE) && ((hello.ring_size & (hello.ring_size - 1)) == 0) &&
+				 (fstat(fds[0], &st) == 0) && ((uint64_t)st.st_size >= sizeof(struct shm_region) + 2 * hello.ring_size);
+	shm_channel channel = NULL;
+	if (valid) {
+		channel = shm_map(fds[0], hello.ring_size, SHM_CLIENT, fds[2], fds[1]);
+	}
+	if (fds[0] >= 0) {
+		close(fds[0]);
+	}
+	if (channel == NULL) {
+		DebugLog("[SHM] Invalid handshake\n");
+		if (fds[1] >= 0) {
+			close(fds[1]);
+		}
+		if (fds[2] >= 0) {
+			close(fds[2]);
+		}
+		errno = EPROTO;
+	}
+	return channel;
+}
+
+int shm_channel_fd(shm_channel channel) {
+	return channel->bell;
+}
+
+ssize_t shm_channel_read(shm_channel channel, char *buffer, size_t len) {
+	struct shm_ring *ring = channel->in;
+	uint64_t tail = channel->in_tail;
+
+	while (42) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head != tail) {
+			// the producer can not be more than one ring ahead
+			size_t available = head - tail;
+			if (available > channel->mask + 1) {
+				DebugLog("[SHM] Invalid ring head, closing channel\n");
+				errno = EPROTO;
+				return -1;
+			}
+
+			// copy out, the data may wrap around the end of the ring
+			if (len > available) {
+				len = available;
+			}
+			size_t offset = tail & channel->mask;
+			size_t first = (len < channel->mask + 1 - offset) ? len : channel->mask + 1 - offset;
+			memcpy(buffer, channel->in_data + offset, first);
+			memcpy(buffer + first, channel->in_data, len - first);
+
+			channel->in_tail = tail + len;
+			__atomic_store_n(&ring->tail, channel->in_tail, __ATOMIC_RELEASE);
+			return len;
+		}
+
+		// producer closes after its last write, so an empty ring is final
+		if (__atomic_load_n(&channel->region->closed[1 - channel->role], __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+				return 0;
+			}
+			continue;
+		}
+
+		// empty: clear the doorbell, tell the producer to ring it and check again
+		uint64_t value;
+		if (read(channel->bell, &value, sizeof(uint64_t)) < 0) {
+			// already cleared
+		}
+		__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail) || __atomic_load_n(&channel->region->closed[1 - channel->role], __ATOMIC_SEQ_CST)) {
+			// data raced in, restore the doorbell in case the caller stops before the ring is empty
+			__atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+			shm_ring_bell(channel->bell);
+			continue;
+		}
+
+		errno = EAGAIN;
+		return -1;
+	}
+}
+
+ssize_t shm_channel_write(shm_channel channel, const char *data, size_t len) {
+	if (__atomic_load_n(&channel->region->closed[1 - channel->role], __ATOMIC_ACQUIRE)) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	struct shm_ring *ring = channel->out;
+	uint64_t head = channel->out_head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	// the consumer can not be ahead of us or more than one ring behind
+	if (head - tail > channel->mask + 1) {
+		DebugLog("[SHM] Invalid ring tail, closing channel\n");
+		errno = EPROTO;
+		return -1;
+	}
+	size_t space = channel->mask + 1 - (head - tail);
+	if (len > space) {
+		len = space;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	// copy in, the data may wrap around the end of the ring
+	size_t offset = head & channel->mask;
+	size_t first = (len < channel->mask + 1 - offset) ? len : channel->mask + 1 - offset;
+	memcpy(channel->out_data + offset, data, first);
+	memcpy(channel->out_data, data + first, len - first);
+	channel->out_head = head + len;
+	__atomic_store_n(&ring->head, channel->out_head, __ATOMIC_RELEASE);
+
+	// only ring if the consumer went to sleep
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+		shm_ring_bell(channel->peer_bell);
+	}
+
+	return len;
+}
+
+bool shm_channel_write_all(shm_channel channel, const char *data, size_t len, int timeout_ms) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int spins = 0;
+	while (len > 0) {
+		ssize_t written = shm_channel_write(channel, data, len);
+		if (written < 0) {
+			return false;
+		}
+		data += written;
+		len -= written;
+		if (written > 0) {
+			spins = 0;
+			continue;
+		}
+
+		// full, give the consumer some time
+		if (spins++ < SHM_SPIN_COUNT) {
+			sched_yield();
+			continue;
+		}
+		if (timeout_ms > 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= timeout_ms) {
+				errno = ETIMEDOUT;
+				return false;
+			}
+		}
+		usleep(50);
+	}
+	return true;
+}
+
+ssize_t shm_channel_receive(shm_channel channel, char *buffer, size_t len, int timeout_ms) {
+	while (42) {
+		ssize_t result = shm_channel_read(channel, buffer, len);
+		if ((result >= 0) || (errno != EAGAIN)) {
+			return result;
+		}
+
+		// sleep until the producer rings
+		struct pollfd p = { channel->bell, POLLIN, 0 };
+		int ready = poll(&p, 1, timeout_ms);
+		if (ready == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if ((ready < 0) && (errno != EINTR)) {
+			return -1;
+		}
+	}
+}
+
+void shm_channel_close(shm_channel channel) {
+	// the peer sees end of file after consuming the rest
+	__atomic_store_n(&channel->region->closed[channel->role], 1, __ATOMIC_SEQ_CST);
+	shm_ring_bell(channel->peer_bell);
+
+	munmap(channel->region, channel->map_size);
+	close(channel->bell);
+	close(channel->peer_bell);
+	free(channel);
+}
+
+#else
+
+shm_channel shm_server_accept(int unix_socket, size_t ring_size) {
+	errno = ENOSYS;
+	return NULL;
+}
+
+shm_channel shm_client_connect(const char *path) {
+	errno = ENOSYS;
+	return NULL;
+}
+
+int shm_channel_fd(shm_channel channel) {
+	return -1;
+}
+
+ssize_t shm_channel_read(shm_channel channel, char *buffer, size_t len) {
+	errno = ENOSYS;
+	return -1;
+}
+
+ssize_t shm_channel_write(shm_channel channel, const char *data, size_t len) {
+	errno = ENOSYS;
+	return -1;
+}
+
+bool shm_channel_write_all(shm_channel channel, const char *data, size_t len, int timeout_ms) {
+	errno = ENOSYS;
+	return false;
+}
+
+ssize_t shm_channel_receive(shm_channel channel, char *buffer, size_t len, int timeout_ms) {
+	errno = ENOSYS;
+	return -1;
+}
+
+void shm_channel_close(shm_channel channel) {
+}
+
+#endif
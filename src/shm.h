@@ -0,0 +1,96 @@
+//
+//  shm.h
+//  UnchainedSocket
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+
+#ifndef __shm_h
+#define __shm_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define SHM_MAGIC 0x55534852 /* 'USHR' */
+#define SHM_VERSION 1
+
+/** Opaque shared memory channel
+ *
+ * A pair of single producer, single consumer byte rings in a memfd mapping, one ring per
+ * direction, with an eventfd doorbell per side. Doorbells are only rung when the consumer
+ * is about to sleep, so a busy stream costs no system calls. Linux only, all functions fail
+ * with ENOSYS on other platforms.
+ */
+typedef struct _shm_channel *shm_channel;
+
+/** Server side of the handshake: create a channel and send it to a client
+ *
+ * @param unix_socket: connected unix socket, may be closed afterwards
+ * @param ring_size: size of each ring in bytes, rounded up to a power of two
+ * @return channel or NULL on failure
+ */
+shm_channel shm_server_accept(int unix_socket, size_t ring_size);
+
+/** Client side of the handshake: connect to a server and map the channel it sends
+ *
+ * @param path: filesystem path of the unix socket the server listens on (see `server_enable_shm`)
+ * @return channel or NULL on failure
+ */
+shm_channel shm_client_connect(const char *path);
+
+/** Descriptor that becomes readable when data arrives, for use with select or poll
+ *
+ * @param channel: the channel
+ * @return eventfd of this side
+ */
+int shm_channel_fd(shm_channel channel);
+
+/** Read available data without blocking, same semantics as `read`
+ *
+ * @param channel: the channel
+ * @param buffer: buffer to read into
+ * @param len: size of the buffer
+ * @return bytes read, 0 if the peer closed the channel, -1 with errno EAGAIN if no data is available
+ *         or EPROTO if the peer corrupted the ring, the channel should be closed then
+ */
+ssize_t shm_channel_read(shm_channel channel, char *buffer, size_t len);
+
+/** Write as much as fits into the ring without blocking
+ *
+ * @param channel: the channel
+ * @param data: data to send
+ * @param len: length of the data
+ * @return bytes written, may be 0 if the ring is full, -1 with errno EPIPE if the peer closed the channel
+ *         or EPROTO if the peer corrupted the ring
+ */
+ssize_t shm_channel_write(shm_channel channel, const char *data, size_t len);
+
+/** Write all data, waits for the peer to make room
+ *
+ * @param channel: the channel
+ * @param data: data to send
+ * @param len: length of the data
+ * @param timeout_ms: give up if the ring stays full this long, 0 to wait forever
+ * @return false if the peer closed the channel or the timeout hit
+ */
+bool shm_channel_write_all(shm_channel channel, const char *data, size_t len, int timeout_ms);
+
+/** Wait for data and read it
+ *
+ * @param channel: the channel
+ * @param buffer: buffer to read into
+ * @param len: size of the buffer
+ * @param timeout_ms: maximum time to wait, -1 to wait forever
+ * @return bytes read, 0 if the peer closed the channel, -1 with errno EAGAIN on timeout
+ */
+ssize_t shm_channel_receive(shm_channel channel, char *buffer, size_t len, int timeout_ms);
+
+/** Close the channel, the peer reads end of file after it consumed all data
+ *
+ * @param channel: the channel, freed by this call
+ */
+void shm_channel_close(shm_channel channel);
+
+#endif /* __shm_h */
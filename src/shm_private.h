@@ -0,0 +1,28 @@
+//
+//  shm_private.h
+//  UnchainedSocket
+//
+//  Part of UnchainedSocket, licensed under 3 Clause BSD License, see LICENSE.txt.
+//
+//  Library internal unix socket helpers, not installed.
+//
+
+#ifndef __shm_private_h
+#define __shm_private_h
+
+/** Create a listening unix socket that only the current user may connect to, replaces a stale socket file
+ *
+ * @param path: filesystem path of the socket
+ * @param backlog: listen queue length
+ * @return socket or -1 with errno set
+ */
+int shm_socket_listen(const char *path, int backlog);
+
+/** Connect to a listening unix socket
+ *
+ * @param path: filesystem path of the socket
+ * @return socket or -1 with errno set
+ */
+int shm_socket_connect(const char *path);
+
+#endif /* __shm_private_h */